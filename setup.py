@@ -1,27 +1,14 @@
 import sys
 from distutils.core import setup, Extension
-from subprocess import Popen, PIPE
 
-def supports_openssl():
-	h = Popen("/sbin/ldconfig -p | grep openssl", shell=True, stdout=PIPE)
-	out, err = h.communicate()
-	return 'openssl' in str(out)
-
-sources = ["src/dht.c", "src/core.c", "src/dht/dht.c"]
-libraries = ["crypt"]
+sources = ["src/dht.c", "src/core.c", "src/blocklist.c", "src/filter.c", "src/dht/dht.c"]
+libraries = ["m"]
 cflags = ["-g", "-Wall"]
 
 if "--enable-verbose" in sys.argv:
 	cflags.append("-DENABLE_VERBOSE")
 	sys.argv.remove("--enable-verbose")
 
-if supports_openssl():
-	libraries.append("crypto")
-	libraries.append("ssl")
-	cflags.append("-DENABLE_OPENSSL")
-else:
-	print("Warning: OpenSSL support not found, using weaker crypto.")
-
 setup(
 	name="PyJCDHT",
 	version="0.0.1",
@@ -0,0 +1,465 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "blocklist.h"
+
+/* Single addresses are kept in open addressing hash sets, where the
+   unspecified address, which is martian anyway, marks an empty slot.
+   Shorter prefixes are kept as sorted, disjoint intervals and found by
+   binary search, so a lookup is O(1) plus O(log n) in the number of
+   ranges whatever the size of the list.  For IPv4, a table indexed by
+   the top 16 bits of the address narrows the search first. */
+
+struct addrset
+{
+	unsigned char *slots;
+	size_t count;
+	int bits;
+};
+
+struct range4
+{
+	uint32_t lo, hi;
+};
+
+struct range6
+{
+	unsigned char lo[16], hi[16];
+};
+
+static struct addrset set4, set6;
+static struct range4 *ranges4 = NULL;
+static struct range6 *ranges6 = NULL;
+static size_t numranges4 = 0, maxranges4 = 0;
+static size_t numranges6 = 0, maxranges6 = 0;
+
+/* index4[k] is the number of IPv4 ranges starting below k << 16, which
+   narrows a search to the ranges of one /16 and its predecessor. */
+static uint32_t *index4 = NULL;
+
+static const unsigned char zeroes[16];
+
+static inline size_t
+addr_hash(const unsigned char *key, int keylen, int bits)
+{
+	uint64_t h = 0;
+	uint32_t w;
+	int i;
+
+	for(i = 0; i < keylen; i += 4)
+	{
+		memcpy(&w, key + i, 4);
+		h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+	}
+	/* The high bits of a multiplicative hash are the well mixed ones. */
+	return (size_t)(h >> (64 - bits));
+}
+
+static inline int
+addrset_find(const struct addrset *set, const unsigned char *key, int keylen)
+{
+	size_t mask, i;
+	const unsigned char *slot;
+
+	/* The unspecified address is never stored, and would match an empty slot. */
+	if(set->count == 0 || memcmp(key, zeroes, keylen) == 0)
+		return 0;
+
+	mask = ((size_t)1 << set->bits) - 1;
+	i = addr_hash(key, keylen, set->bits);
+	while(1)
+	{
+		slot = set->slots + i * keylen;
+		if(memcmp(slot, key, keylen) == 0)
+			return 1;
+		if(memcmp(slot, zeroes, keylen) == 0)
+			return 0;
+		i = (i + 1) & mask;
+	}
+}
+
+static void
+addrset_put(struct addrset *set, const unsigned char *key, int keylen)
+{
+	size_t mask = ((size_t)1 << set->bits) - 1;
+	size_t i = addr_hash(key, keylen, set->bits);
+	unsigned char *slot;
+
+	while(1)
+	{
+		slot = set->slots + i * keylen;
+		if(memcmp(slot, key, keylen) == 0)
+			return;
+		if(memcmp(slot, zeroes, keylen) == 0)
+			break;
+		i = (i + 1) & mask;
+	}
+	memcpy(slot, key, keylen);
+	set->count++;
+}
+
+/* Keep the load factor at most one half. */
+static int
+addrset_insert(struct addrset *set, const unsigned char *key, int keylen)
+{
+	if(memcmp(key, zeroes, keylen) == 0)
+		return 0;
+
+	if(set->slots == NULL || (set->count + 1) * 2 > ((size_t)1 << set->bits))
+	{
+		struct addrset grown;
+		size_t i, size;
+
+		grown.bits = set->slots == NULL ? 10 : set->bits + 1;
+		grown.count = 0;
+		grown.slots = calloc((size_t)1 << grown.bits, keylen);
+		if(grown.slots == NULL)
+			return -1;
+
+		size = set->slots == NULL ? 0 : (size_t)1 << set->bits;
+		for(i = 0; i < size; i++)
+		{
+			if(memcmp(set->slots + i * keylen, zeroes, keylen) != 0)
+				addrset_put(&grown, set->slots + i * keylen, keylen);
+		}
+		free(set->slots);
+		*set = grown;
+	}
+
+	addrset_put(set, key, keylen);
+	return 0;
+}
+
+static int
+range4_cmp(const void *a, const void *b)
+{
+	const struct range4 *x = a, *y = b;
+
+	if(x->lo != y->lo)
+		return x->lo < y->lo ? -1 : 1;
+	return 0;
+}
+
+static int
+range6_cmp(const void *a, const void *b)
+{
+	const struct range6 *x = a, *y = b;
+
+	return memcmp(x->lo, y->lo, 16);
+}
+
+/* Sort the ranges and merge those that overlap. */
+static void
+ranges_normalise(void)
+{
+	size_t i, n;
+
+	if(numranges4 > 0)
+	{
+		qsort(ranges4, numranges4, sizeof(struct range4), range4_cmp);
+		n = 1;
+		for(i = 1; i < numranges4; i++)
+		{
+			if(ranges4[i].lo <= ranges4[n - 1].hi)
+			{
+				if(ranges4[i].hi > ranges4[n - 1].hi)
+					ranges4[n - 1].hi = ranges4[i].hi;
+			}
+			else
+			{
+				ranges4[n++] = ranges4[i];
+			}
+		}
+		numranges4 = n;
+
+		if(index4 == NULL)
+			index4 = malloc(65537 * sizeof(uint32_t));
+		if(index4 != NULL)
+		{
+			n = 0;
+			for(i = 0; i <= 65536; i++)
+			{
+				while(n < numranges4 && (ranges4[n].lo >> 16) < i)
+					n++;
+				index4[i] = n;
+			}
+		}
+	}
+
+	if(numranges6 > 0)
+	{
+		qsort(ranges6, numranges6, sizeof(struct range6), range6_cmp);
+		n = 1;
+		for(i = 1; i < numranges6; i++)
+		{
+			if(memcmp(ranges6[i].lo, ranges6[n - 1].hi, 16) <= 0)
+			{
+				if(memcmp(ranges6[i].hi, ranges6[n - 1].hi, 16) > 0)
+					memcpy(ranges6[n - 1].hi, ranges6[i].hi, 16);
+			}
+			else
+			{
+				ranges6[n++] = ranges6[i];
+			}
+		}
+		numranges6 = n;
+	}
+}
+
+static int
+add_range4(const unsigned char *addr, int prefix)
+{
+	uint32_t a, mask;
+
+	if(numranges4 >= maxranges4)
+	{
+		size_t n = maxranges4 == 0 ? 256 : maxranges4 * 2;
+		struct range4 *r = realloc(ranges4, n * sizeof(struct range4));
+		if(r == NULL)
+			return -1;
+		ranges4 = r;
+		maxranges4 = n;
+	}
+
+	memcpy(&a, addr, 4);
+	a = ntohl(a);
+	mask = prefix == 0 ? 0 : 0xFFFFFFFFU << (32 - prefix);
+	ranges4[numranges4].lo = a & mask;
+	ranges4[numranges4].hi = a | ~mask;
+	numranges4++;
+	return 0;
+}
+
+static int
+add_range6(const unsigned char *addr, int prefix)
+{
+	struct range6 *r;
+	int i, keep;
+
+	if(numranges6 >= maxranges6)
+	{
+		size_t n = maxranges6 == 0 ? 256 : maxranges6 * 2;
+		r = realloc(ranges6, n * sizeof(struct range6));
+		if(r == NULL)
+			return -1;
+		ranges6 = r;
+		maxranges6 = n;
+	}
+
+	r = &ranges6[numranges6];
+	for(i = 0; i < 16; i++)
+	{
+		keep = prefix - 8 * i;
+		if(keep >= 8)
+		{
+			r->lo[i] = r->hi[i] = addr[i];
+		}
+		else if(keep <= 0)
+		{
+			r->lo[i] = 0;
+			r->hi[i] = 0xFF;
+		}
+		else
+		{
+			unsigned char mask = 0xFF << (8 - keep);
+			r->lo[i] = addr[i] & mask;
+			r->hi[i] = addr[i] | (unsigned char)~mask;
+		}
+	}
+	numranges6++;
+	return 0;
+}
+
+/* Add a packed array of records, returning the number of records or -1
+   with errno set.  The whole buffer is checked before anything is added. */
+int
+blocklist_add(int af, const unsigned char *records, size_t len)
+{
+	size_t reclen, i;
+	int bits, prefix, rc = 0;
+
+	if(af == AF_INET)
+	{
+		reclen = BLOCKLIST_RECORD4;
+		bits = 32;
+	}
+	else if(af == AF_INET6)
+	{
+		reclen = BLOCKLIST_RECORD6;
+		bits = 128;
+	}
+	else
+	{
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+
+	if(len % reclen != 0 || len / reclen > INT32_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	for(i = reclen - 1; i < len; i += reclen)
+	{
+		if(records[i] > bits)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	for(i = 0; i < len && rc == 0; i += reclen)
+	{
+		prefix = records[i + reclen - 1];
+		if(af == AF_INET)
+		{
+			if(prefix == 32)
+				rc = addrset_insert(&set4, records + i, 4);
+			else
+				rc = add_range4(records + i, prefix);
+		}
+		else
+		{
+			if(prefix == 128)
+				rc = addrset_insert(&set6, records + i, 16);
+			else
+				rc = add_range6(records + i, prefix);
+		}
+	}
+
+	/* Lookups rely on the ranges being sorted even after a failure. */
+	ranges_normalise();
+
+	if(rc < 0)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	return (int)(len / reclen);
+}
+
+void
+blocklist_clear(void)
+{
+	free(set4.slots);
+	free(set6.slots);
+	memset(&set4, 0, sizeof(set4));
+	memset(&set6, 0, sizeof(set6));
+	free(ranges4);
+	free(ranges6);
+	free(index4);
+	ranges4 = NULL;
+	index4 = NULL;
+	ranges6 = NULL;
+	numranges4 = maxranges4 = 0;
+	numranges6 = maxranges6 = 0;
+}
+
+int
+blocklist_match(const struct sockaddr *sa)
+{
+	size_t lo, hi, mid;
+
+	if(sa->sa_family == AF_INET)
+	{
+		const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+		const unsigned char *key = (const unsigned char*)&sin->sin_addr;
+		uint32_t a;
+
+		if(addrset_find(&set4, key, 4))
+			return 1;
+		if(numranges4 == 0)
+			return 0;
+
+		a = ntohl(sin->sin_addr.s_addr);
+		/* Find the last range starting at or before a. */
+		lo = index4 ? index4[a >> 16] : 0;
+		hi = index4 ? index4[(a >> 16) + 1] : numranges4;
+		while(lo < hi)
+		{
+			mid = lo + (hi - lo) / 2;
+			if(ranges4[mid].lo <= a)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo > 0 && a <= ranges4[lo - 1].hi;
+	}
+	else if(sa->sa_family == AF_INET6)
+	{
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+		const unsigned char *key = (const unsigned char*)&sin6->sin6_addr;
+
+		if(addrset_find(&set6, key, 16))
+			return 1;
+		if(numranges6 == 0)
+			return 0;
+
+		lo = 0;
+		hi = numranges6;
+		while(lo < hi)
+		{
+			mid = lo + (hi - lo) / 2;
+			if(memcmp(ranges6[mid].lo, key, 16) <= 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo > 0 && memcmp(key, ranges6[lo - 1].hi, 16) <= 0;
+	}
+
+	return 0;
+}
+
+void
+blocklist_count(size_t *addresses, size_t *ranges)
+{
+	*addresses = set4.count + set6.count;
+	*ranges = numranges4 + numranges6;
+}
+
+static int
+range4_width_cmp(const void *a, const void *b)
+{
+	const struct range4 *x = a, *y = b;
+
+	if(x->hi - x->lo != y->hi - y->lo)
+		return x->hi - x->lo > y->hi - y->lo ? -1 : 1;
+	return range4_cmp(a, b);
+}
+
+/* Copy at most max of the widest IPv4 ranges, in host byte order and
+   sorted by address, and return how many there were. */
+int
+blocklist_widest4(uint32_t *lo, uint32_t *hi, int max)
+{
+	struct range4 *r = ranges4;
+	size_t i, n = numranges4;
+
+	if(max < 0)
+		max = 0;
+	if(n > (size_t)max)
+	{
+		r = malloc(numranges4 * sizeof(struct range4));
+		if(r == NULL)
+			return -1;
+		memcpy(r, ranges4, numranges4 * sizeof(struct range4));
+		qsort(r, numranges4, sizeof(struct range4), range4_width_cmp);
+		n = max;
+		qsort(r, n, sizeof(struct range4), range4_cmp);
+	}
+
+	for(i = 0; i < n; i++)
+	{
+		lo[i] = r[i].lo;
+		hi[i] = r[i].hi;
+	}
+
+	if(r != ranges4)
+		free(r);
+	return (int)n;
+}
@@ -0,0 +1,19 @@
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Records are an address in network byte order followed by a prefix
+   length byte, 5 bytes each for IPv4 and 17 bytes each for IPv6. */
+#define BLOCKLIST_RECORD4 5
+#define BLOCKLIST_RECORD6 17
+
+int blocklist_add(int af, const unsigned char *records, size_t len);
+void blocklist_clear(void);
+int blocklist_match(const struct sockaddr *sa);
+void blocklist_count(size_t *addresses, size_t *ranges);
+int blocklist_widest4(uint32_t *lo, uint32_t *hi, int max);
+
+#endif /* BLOCKLIST_H */
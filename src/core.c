@@ -1,11 +1,6 @@
 /* This example code was written by Juliusz Chroboczek.
    You are free to cut'n'paste from it to your heart's content. */
 
-/* For crypt */
-#if defined(_GNU_SOURCE) && !defined(ENABLE_OPENSSL)
-#define _GNU_SOURCE
-#endif
-
 #include <Python.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,19 +9,28 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sys/signal.h>
 #include <assert.h>
+#include <math.h>
+
+#ifdef __linux__
+#include <linux/sock_diag.h>
+#endif
 
-#ifdef ENABLE_OPENSSL
-#include <openssl/sha.h>
-#include <openssl/rand.h>
+/* Python's configure has already looked for getrandom. */
+#if defined(HAVE_GETRANDOM) && defined(HAVE_SYS_RANDOM_H)
+#include <sys/random.h>
+#define USE_GETRANDOM
 #endif
 
 #include "core.h"
+#include "blocklist.h"
+#include "filter.h"
 #include "dht/dht.h"
 
 PyObject* DHTError;
@@ -58,6 +62,22 @@ static PyObject* JCDHT_callback_stub(JCDHT* self, PyObject* args)
 	Py_RETURN_NONE;
 }
 
+/* Estimate the number of addresses in a BEP 33 bloom filter, which has
+   2048 bits and two hash functions. */
+static int bloom_estimate(const uint8_t *bloom)
+{
+	int i, zeros = 0;
+	
+	for(i = 0; i < 2048; i++)
+	{
+		if(!(bloom[i / 8] & (1 << (i % 8))))
+			zeros++;
+	}
+	if(zeros == 0)
+		zeros = 1;
+	return (int)(log(zeros / 2048.0) / (2 * log(1 - 1 / 2048.0)) + 0.5);
+}
+
 static void callback_search(void *self, int event, const unsigned char *info_hash,
                                                 const void *data, size_t data_len)
 {
@@ -72,6 +92,25 @@ static void callback_search(void *self, int event, const unsigned char *info_has
 		return;
 	}
 	
+	if(event == DHT_EVENT_SCRAPE)
+	{
+		PyObject *counts, *res;
+		const uint8_t *bloom = data;
+		
+		assert(data_len == 512);
+		counts = Py_BuildValue("(ii)", bloom_estimate(bloom), bloom_estimate(bloom + 256));
+		if(counts == NULL)
+			return;
+#if PY_MAJOR_VERSION < 3
+		res = PyObject_CallMethod((PyObject*)self, "on_search", "is#O", event, info_hash, 20, counts);
+#else
+		res = PyObject_CallMethod((PyObject*)self, "on_search", "iy#O", event, info_hash, 20, counts);
+#endif
+		Py_XDECREF(res);
+		Py_DECREF(counts);
+		return;
+	}
+	
 	Py_ssize_t num_results;
 	switch(event)
 	{
@@ -80,6 +119,10 @@ static void callback_search(void *self, int event, const unsigned char *info_has
 			assert(data_len % 6 == 0);
 			break;
 		case DHT_EVENT_VALUES6:
+			num_results = data_len / 18;
+			assert(data_len % 18 == 0);
+			break;
+		case DHT_EVENT_SAMPLES:
 			num_results = data_len / 20;
 			assert(data_len % 20 == 0);
 			break;
@@ -88,13 +131,17 @@ static void callback_search(void *self, int event, const unsigned char *info_has
 			break;
 	}
 	
-	PyObject *peerlist = PyList_New(num_results);
+	PyObject *peerlist, *res;
 	char stringbuf[INET6_ADDRSTRLEN];
 	const uint8_t * walk = data;
 	uint16_t portbuf;
 	PyObject *tup;
 	int i;
 	
+	peerlist = PyList_New(num_results);
+	if(peerlist == NULL)
+		return;
+	
 	if(event == DHT_EVENT_VALUES)
 	{
 		for(i=0; i<num_results; i++)
@@ -102,6 +149,7 @@ static void callback_search(void *self, int event, const unsigned char *info_has
 			if(inet_ntop(AF_INET, walk, stringbuf, sizeof(stringbuf)) == NULL)
 			{
 				PyErr_SetFromErrno(PyExc_OSError);
+				Py_DECREF(peerlist);
 				return;
 			}
 			
@@ -110,7 +158,31 @@ static void callback_search(void *self, int event, const unsigned char *info_has
 			walk += 2;
 			
 			tup = Py_BuildValue("(si)", stringbuf, ntohs(portbuf));
+			if(tup == NULL)
+			{
+				Py_DECREF(peerlist);
+				return;
+			}
+			PyList_SET_ITEM(peerlist, i, tup);
+		}
+	}
+
+	if(event == DHT_EVENT_SAMPLES)
+	{
+		for(i=0; i<num_results; i++)
+		{
+#if PY_MAJOR_VERSION < 3
+			tup = PyString_FromStringAndSize((const char*)walk, 20);
+#else
+			tup = PyBytes_FromStringAndSize((const char*)walk, 20);
+#endif
+			if(tup == NULL)
+			{
+				Py_DECREF(peerlist);
+				return;
+			}
 			PyList_SET_ITEM(peerlist, i, tup);
+			walk += 20;
 		}
 	}
 
@@ -121,6 +193,7 @@ static void callback_search(void *self, int event, const unsigned char *info_has
 			if(inet_ntop(AF_INET6, walk, stringbuf, sizeof(stringbuf)) == NULL)
 			{
 				PyErr_SetFromErrno(PyExc_OSError);
+				Py_DECREF(peerlist);
 				return;
 			}
 			
@@ -129,22 +202,28 @@ static void callback_search(void *self, int event, const unsigned char *info_has
 			walk += 2;
 			
 			tup = Py_BuildValue("(si)", stringbuf, ntohs(portbuf));
+			if(tup == NULL)
+			{
+				Py_DECREF(peerlist);
+				return;
+			}
 			PyList_SET_ITEM(peerlist, i, tup);
 		}
 	}
 	
 #if PY_MAJOR_VERSION < 3
-	PyObject_CallMethod((PyObject*)self, "on_search", "is#O", event, info_hash, 20, peerlist);
+	res = PyObject_CallMethod((PyObject*)self, "on_search", "is#O", event, info_hash, 20, peerlist);
 #else
-	PyObject_CallMethod((PyObject*)self, "on_search", "iy#O", event, info_hash, 20, peerlist);
+	res = PyObject_CallMethod((PyObject*)self, "on_search", "iy#O", event, info_hash, 20, peerlist);
 #endif
+	Py_XDECREF(res);
+	Py_DECREF(peerlist);
 }
 
 static int init_helper(JCDHT* self, PyObject* args)
 {
 	if(self->dht == NULL)
 	{
-		unsigned seed;
 		DHT *dht = malloc(sizeof(DHT));
 		if(!dht)
 		{
@@ -155,10 +234,11 @@ static int init_helper(JCDHT* self, PyObject* args)
 		dht->s = -1;
 		dht->s6 = -1;
 		dht->have_id = 0;
+		dht->filter = 0;
 		dht->tosleep = 0;
 		
-		dht_random_bytes(&seed, sizeof(seed));
-		srandom(seed);
+		dht_random_bytes(&dht->prng, sizeof(dht->prng));
+		dht->prng |= 1;
 		
 		self->dht = dht;
 		
@@ -201,6 +281,7 @@ static int init_helper(JCDHT* self, PyObject* args)
 		
 		dht->ipv4 = (DHT_IPV4 & sockflags) == DHT_IPV4;
 		dht->ipv6 = (DHT_IPV6 & sockflags) == DHT_IPV6;
+		dht->filter = (DHT_FILTER & sockflags) == DHT_FILTER;
 		if(dht->ipv4 == 0 && dht->ipv6 == 0)
 		{
 			PyErr_SetString(PyExc_ValueError, "At least one network stack must be enabled");
@@ -302,6 +383,16 @@ bound:
 			}
 		}
 
+		if(dht->filter)
+		{
+			if((dht->s >= 0 && filter_attach(dht->s, AF_INET, DHT_RECV_SIZE) < 0) ||
+			   (dht->s6 >= 0 && filter_attach(dht->s6, AF_INET6, DHT_RECV_SIZE) < 0))
+			{
+				PyErr_SetString(PyExc_IOError, "Error attaching socket filter");
+				return -1;
+			}
+		}
+
 		/* Init the dht.  This sets the socket into non-blocking mode. */
 		rc = dht_init(dht->s, dht->s6, dht->myid, NULL);
 		if(rc < 0)
@@ -315,21 +406,51 @@ bound:
 	return 0;
 }
 
+/* A xorshift generator of the instance's own, for sleep jitter. */
+static uint32_t jitter_random(DHT *dht)
+{
+	uint32_t x = dht->prng;
+	
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return dht->prng = x;
+}
+
+/* How full the receive queue of s is, in percent of its buffer. */
+static int queue_load(int s)
+{
+#ifdef SO_MEMINFO
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(mem);
+	
+	if(getsockopt(s, SOL_SOCKET, SO_MEMINFO, mem, &len) < 0 ||
+	   mem[SK_MEMINFO_RCVBUF] == 0)
+		return 0;
+	return (int)((uint64_t)mem[SK_MEMINFO_RMEM_ALLOC] * 100 / mem[SK_MEMINFO_RCVBUF]);
+#else
+	return 0;
+#endif
+}
+
 static PyObject* JCDHT_do(JCDHT *self, PyObject* args)
 {
 	CHECK_DHT(self);
 	
 	struct timeval tv;
 	fd_set readfds;
-	unsigned char buf[4096];
+	unsigned char buf[DHT_RECV_SIZE];
 	int s = self->dht->s;
 	int s6 = self->dht->s6;
     struct sockaddr_storage from;
     socklen_t fromlen;
-	int rc;
+	int rc, sock, load, i;
+	ssize_t n;
 	
-	tv.tv_sec = self->dht->tosleep;
-	tv.tv_usec = random() % 1000000;
+	/* Long sleeps get some jitter, short ones are search deadlines. */
+	dht_timeout(&tv);
+	if(tv.tv_sec > 0)
+		tv.tv_usec = jitter_random(self->dht) % 1000000;
 
 	FD_ZERO(&readfds);
 	if(s >= 0)
@@ -346,31 +467,44 @@ static PyObject* JCDHT_do(JCDHT *self, PyObject* args)
 		}
 	}
 
+	sock = -1;
 	if(rc > 0)
 	{
-		fromlen = sizeof(from);
 		if(s >= 0 && FD_ISSET(s, &readfds))
-			rc = recvfrom(s, buf, sizeof(buf) - 1, 0,
-			              (struct sockaddr*)&from, &fromlen);
+			sock = s;
 		else if(s6 >= 0 && FD_ISSET(s6, &readfds))
-			rc = recvfrom(s6, buf, sizeof(buf) - 1, 0,
-			              (struct sockaddr*)&from, &fromlen);
+			sock = s6;
 		else
 			{
 				PyErr_SetString(DHTError, "socket error");
 				return NULL;
 			}
 	}
-
-	if(rc > 0)
-	{
-		buf[rc] = '\0';
-		rc = dht_periodic(buf, rc, (struct sockaddr*)&from, fromlen,
-		                  &self->dht->tosleep, callback_search, self);
-	}
-	else
+	
+	/* Under load, drain several datagrams before going back to Python. */
+	load = sock >= 0 ? queue_load(sock) : 0;
+	dht_set_load(load);
+	
+	for(i = 0; i < (load > 0 ? DHT_RECV_BATCH : 1); i++)
 	{
-		rc = dht_periodic(NULL, 0, NULL, 0, &self->dht->tosleep, callback_search, self);
+		n = -1;
+		if(sock >= 0)
+		{
+			fromlen = sizeof(from);
+			n = recvfrom(sock, buf, sizeof(buf), i > 0 ? MSG_DONTWAIT : 0,
+			             (struct sockaddr*)&from, &fromlen);
+		}
+		
+		if(n > 0)
+			rc = dht_periodic(buf, n, (struct sockaddr*)&from, fromlen,
+			                  &self->dht->tosleep, callback_search, self);
+		else if(i == 0)
+			rc = dht_periodic(NULL, 0, NULL, 0, &self->dht->tosleep, callback_search, self);
+		else
+			break;
+		
+		if(rc < 0 || PyErr_Occurred())
+			break;
 	}
 	if(rc < 0)
 	{
@@ -512,6 +646,226 @@ static PyObject* JCDHT_get_nodes(JCDHT* self, PyObject* args)
 	return nodes;
 }
 
+static PyObject* JCDHT_set_option(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	int option, value;
+	
+	if(!PyArg_ParseTuple(args, "ii", &option, &value))
+	{
+		PyErr_SetString(PyExc_ValueError, "Failed to parse arguments");
+		return NULL;
+	}
+	
+	if(dht_set_option(option, value) < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Unknown option or invalid value");
+		return NULL;
+	}
+	
+	Py_RETURN_NONE;
+}
+
+static PyObject* JCDHT_get_option(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	int option, value;
+	
+	if(!PyArg_ParseTuple(args, "i", &option))
+	{
+		PyErr_SetString(PyExc_ValueError, "Failed to parse arguments");
+		return NULL;
+	}
+	
+	value = dht_get_option(option);
+	if(value < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Unknown option");
+		return NULL;
+	}
+	
+	return PyLong_FromLong(value);
+}
+
+/* The IPv4 socket filter carries blocklist ranges, rebuild it. */
+static int refresh_filter(DHT *dht)
+{
+	if(dht->filter && dht->s >= 0 &&
+	   filter_attach(dht->s, AF_INET, DHT_RECV_SIZE) < 0)
+	{
+		PyErr_SetString(PyExc_IOError, "Error attaching socket filter");
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject* JCDHT_blocklist(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	Py_buffer records;
+	int family = DHT_IPV4, rc;
+	
+#if PY_MAJOR_VERSION < 3
+	rc = PyArg_ParseTuple(args, "s*|i", &records, &family);
+#else
+	rc = PyArg_ParseTuple(args, "y*|i", &records, &family);
+#endif
+
+	if(!rc)
+	{
+		PyErr_SetString(PyExc_ValueError, "Failed to parse arguments");
+		return NULL;
+	}
+	
+	if(family != DHT_IPV4 && family != DHT_IPV6)
+	{
+		PyBuffer_Release(&records);
+		PyErr_SetString(PyExc_ValueError, "Family must be either DHT.IPV4 or DHT.IPV6");
+		return NULL;
+	}
+	
+	rc = blocklist_add(family == DHT_IPV4 ? AF_INET : AF_INET6,
+	                   records.buf, records.len);
+	PyBuffer_Release(&records);
+	if(rc < 0)
+	{
+		if(errno == ENOMEM)
+			return PyErr_NoMemory();
+		PyErr_SetString(PyExc_ValueError, "Records must be an address and a prefix length");
+		return NULL;
+	}
+	
+	if(family == DHT_IPV4 && refresh_filter(self->dht) < 0)
+		return NULL;
+	
+	return PyLong_FromLong(rc);
+}
+
+static PyObject* JCDHT_blocklist_clear(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	blocklist_clear();
+	
+	if(refresh_filter(self->dht) < 0)
+		return NULL;
+	
+	Py_RETURN_NONE;
+}
+
+static PyObject* JCDHT_blocklist_count(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	size_t addresses, ranges;
+	
+	blocklist_count(&addresses, &ranges);
+	
+	return Py_BuildValue("(nn)", (Py_ssize_t)addresses, (Py_ssize_t)ranges);
+}
+
+static PyObject* JCDHT_blocked(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	char *addr;
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in*)&ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&ss;
+	
+	if(!PyArg_ParseTuple(args, "s", &addr))
+	{
+		PyErr_SetString(PyExc_ValueError, "Failed to parse arguments");
+		return NULL;
+	}
+	
+	memset(&ss, 0, sizeof(ss));
+	if(inet_pton(AF_INET, addr, &sin->sin_addr) == 1)
+	{
+		sin->sin_family = AF_INET;
+	}
+	else if(inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1)
+	{
+		sin6->sin6_family = AF_INET6;
+	}
+	else
+	{
+		PyErr_SetString(PyExc_ValueError, "Failed to parse address");
+		return NULL;
+	}
+	
+	if(blocklist_match((struct sockaddr*)&ss))
+	{
+		Py_RETURN_TRUE;
+	}
+	
+	Py_RETURN_FALSE;
+}
+
+static PyObject* JCDHT_stats(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	static const char *names[] = {
+		NULL, "reply", "ping", "find_node", "get_peers", "announce_peer",
+		"sample_infohashes"
+	};
+	unsigned long received, limited, shed;
+	PyObject *stats, *tup;
+	int i;
+	
+	stats = PyDict_New();
+	if(stats == NULL)
+		return NULL;
+	
+	for(i = DHT_MESSAGE_REPLY; i <= DHT_MESSAGE_SAMPLE_INFOHASHES; i++)
+	{
+		dht_message_stats(i, &received, &limited, &shed);
+		tup = Py_BuildValue("(kkk)", received, limited, shed);
+		if(tup == NULL || PyDict_SetItemString(stats, names[i], tup) < 0)
+		{
+			Py_XDECREF(tup);
+			Py_DECREF(stats);
+			return NULL;
+		}
+		Py_DECREF(tup);
+	}
+	
+	return stats;
+}
+
+static PyObject* JCDHT_send_stats(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	static const char *names[] = {"reply", "search", "maintenance"};
+	unsigned long sent, deferred, dropped;
+	PyObject *stats, *tup;
+	int i;
+	
+	stats = PyDict_New();
+	if(stats == NULL)
+		return NULL;
+	
+	for(i = DHT_SEND_REPLY; i <= DHT_SEND_MAINTENANCE; i++)
+	{
+		dht_send_stats(i, &sent, &deferred, &dropped);
+		tup = Py_BuildValue("(kkk)", sent, deferred, dropped);
+		if(tup == NULL || PyDict_SetItemString(stats, names[i], tup) < 0)
+		{
+			Py_XDECREF(tup);
+			Py_DECREF(stats);
+			return NULL;
+		}
+		Py_DECREF(tup);
+	}
+	
+	return stats;
+}
+
 static PyObject* JCDHT_dump(JCDHT* self, PyObject* args)
 {
 	CHECK_DHT(self);
@@ -528,85 +882,119 @@ static PyObject* JCDHT_dump(JCDHT* self, PyObject* args)
 int
 dht_blacklisted(const struct sockaddr *sa, int salen)
 {
-	return 0;
+	return blocklist_match(sa);
 }
 
-/* We need to provide a reasonably strong cryptographic hashing function.
-   Here's how we'd do it if we had OpenSSL's SHA1 code. */
-#ifdef ENABLE_OPENSSL
-void dht_hash(void *hash_return, int hash_size,
-         const void *v1, int len1,
-         const void *v2, int len2,
-         const void *v3, int len3)
-{
-	SHA_CTX sha;
+/* Secure random bytes come from the kernel a pool at a time.  Bytes are
+   wiped as they are handed out, and the pool is dropped after a fork so
+   that parent and child never share any. */
+static unsigned char random_pool[256];
+static size_t random_avail = 0;
+static int random_atfork = 0;
 
-	SHA1_Init(&sha);
-	SHA1_Update(&sha, v1, len1);
-	SHA1_Update(&sha, v2, len2);
-	SHA1_Update(&sha, v3, len3);
-
-	SHA1_Final(hash_return, &sha);
+static void random_forget(void)
+{
+	memset(random_pool, 0, sizeof(random_pool));
+	random_avail = 0;
 }
-#else
-/* But for this example, we might as well use something weaker. */
-void dht_hash(void *hash_return, int hash_size,
-         const void *v1, int len1,
-         const void *v2, int len2,
-         const void *v3, int len3)
-{
-	const char *c1 = v1, *c2 = v2, *c3 = v3;
-	char key[9];                /* crypt is limited to 8 characters */
-	int i;
 
-	memset(key, 0, 9);
-#define CRYPT_HAPPY(c) ((c % 0x60) + 0x20)
+static int fill_random(void *buf, size_t size)
+{
+	size_t n = 0;
+	ssize_t rc;
+	int fd, save;
 
-	for(i = 0; i < 2 && i < len1; i++)
-		key[i] = CRYPT_HAPPY(c1[i]);
-	for(i = 0; i < 4 && i < len1; i++)
-		key[2 + i] = CRYPT_HAPPY(c2[i]);
-	for(i = 0; i < 2 && i < len1; i++)
-		key[6 + i] = CRYPT_HAPPY(c3[i]);
-	strncpy(hash_return, crypt(key, "jc"), hash_size);
-}
+#ifdef USE_GETRANDOM
+	while(n < size)
+	{
+		rc = getrandom((char*)buf + n, size - n, 0);
+		if(rc < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != ENOSYS)
+				return -1;
+			break;
+		}
+		n += rc;
+	}
+	if(n == size)
+		return 0;
 #endif
 
-int dht_random_bytes(void *buf, size_t size)
-{
-	int fd, rc, save;
-	
-#ifdef ENABLE_OPENSSL
-	rc = RAND_pseudo_bytes(buf, size);
-	if(rc == 1)
-		return size;
-#endif
-	
 	fd = open("/dev/urandom", O_RDONLY);
 	if(fd < 0)
 		return -1;
 
-	rc = read(fd, buf, size);
+	while(n < size)
+	{
+		rc = read(fd, (char*)buf + n, size - n);
+		if(rc <= 0)
+		{
+			if(rc < 0 && errno == EINTR)
+				continue;
+			save = errno;
+			close(fd);
+			errno = save;
+			return -1;
+		}
+		n += rc;
+	}
 
-	save = errno;
 	close(fd);
-	errno = save;
+	return 0;
+}
+
+int dht_random_bytes(void *buf, size_t size)
+{
+	unsigned char *p = buf, *src;
+	size_t n, left = size;
+
+	if(size > sizeof(random_pool))
+		return fill_random(buf, size) < 0 ? -1 : (int)size;
+
+	if(!random_atfork)
+	{
+		if(pthread_atfork(NULL, NULL, random_forget) != 0)
+			return fill_random(buf, size) < 0 ? -1 : (int)size;
+		random_atfork = 1;
+	}
+
+	while(left > 0)
+	{
+		if(random_avail == 0)
+		{
+			if(fill_random(random_pool, sizeof(random_pool)) < 0)
+				return -1;
+			random_avail = sizeof(random_pool);
+		}
+		n = left < random_avail ? left : random_avail;
+		src = random_pool + sizeof(random_pool) - random_avail;
+		memcpy(p, src, n);
+		memset(src, 0, n);
+		random_avail -= n;
+		p += n;
+		left -= n;
+	}
 
-	return rc;
+	return size;
 }
 
-static PyObject* JCDHT_search(JCDHT* self, PyObject* args)
+static PyObject* JCDHT_search(JCDHT* self, PyObject* args, PyObject* kwds)
 {
 	CHECK_DHT(self);
 	
 	DHT *dht = self->dht;
 	unsigned char *infohash;
-	int hashlen, rc, port = 0;
+	int hashlen, rc, port = 0, max_peers = 0, priority = 0;
+	static char *kwlist[] = {"infohash", "port", "max_peers", "priority", NULL};
 	
 #if PY_MAJOR_VERSION < 3
-	rc = PyArg_ParseTuple(args, "s#|i", &infohash, &hashlen, &port);
+	rc = PyArg_ParseTupleAndKeywords(args, kwds, "s#|iii", kwlist,
+	                                 &infohash, &hashlen, &port, &max_peers, &priority);
 #else
-	rc = PyArg_ParseTuple(args, "y#|i", &infohash, &hashlen, &port);
+	rc = PyArg_ParseTupleAndKeywords(args, kwds, "y#|iii", kwlist,
+	                                 &infohash, &hashlen, &port, &max_peers, &priority);
 #endif
 
 	if(!rc)
@@ -626,10 +1014,17 @@ static PyObject* JCDHT_search(JCDHT* self, PyObject* args)
 		PyErr_SetString(PyExc_ValueError, "Wrong port value");
 		return NULL;
 	}
+	
+	if(max_peers < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Wrong max_peers value");
+		return NULL;
+	}
 
 	if(dht->s >= 0)
 	{
-		rc = dht_search(infohash, port, AF_INET, callback_search, self);
+		rc = dht_search_ext(infohash, port, AF_INET, max_peers, priority,
+		                    callback_search, self);
 		if(rc == -1)
 		{
 			Py_RETURN_FALSE;
@@ -637,7 +1032,8 @@ static PyObject* JCDHT_search(JCDHT* self, PyObject* args)
 	}
 	if(dht->s6 >= 0)
 	{
-		rc = dht_search(infohash, port, AF_INET6, callback_search, self);
+		rc = dht_search_ext(infohash, port, AF_INET6, max_peers, priority,
+		                    callback_search, self);
 		if(rc == -1)
 		{
 			Py_RETURN_FALSE;
@@ -647,6 +1043,198 @@ static PyObject* JCDHT_search(JCDHT* self, PyObject* args)
 	Py_RETURN_TRUE;
 }
 
+static PyObject* JCDHT_scrape(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	DHT *dht = self->dht;
+	unsigned char *infohash;
+	int hashlen, rc;
+	
+#if PY_MAJOR_VERSION < 3
+	rc = PyArg_ParseTuple(args, "s#", &infohash, &hashlen);
+#else
+	rc = PyArg_ParseTuple(args, "y#", &infohash, &hashlen);
+#endif
+
+	if(!rc)
+	{
+		PyErr_SetString(PyExc_ValueError, "Failed to parse arguments");
+		return NULL;
+	}
+	
+	if(hashlen != 20)
+	{
+		PyErr_SetString(PyExc_ValueError, "ID must be 20 bytes");
+		return NULL;
+	}
+	
+	/* The filters cover peers of both families, one search is enough. */
+	rc = dht_scrape(infohash, dht->s >= 0 ? AF_INET : AF_INET6,
+	                callback_search, self);
+	if(rc == -1)
+	{
+		Py_RETURN_FALSE;
+	}
+	
+	Py_RETURN_TRUE;
+}
+
+static PyObject* JCDHT_sample(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	DHT *dht = self->dht;
+	unsigned char *target;
+	int hashlen, rc;
+	
+#if PY_MAJOR_VERSION < 3
+	rc = PyArg_ParseTuple(args, "s#", &target, &hashlen);
+#else
+	rc = PyArg_ParseTuple(args, "y#", &target, &hashlen);
+#endif
+
+	if(!rc)
+	{
+		PyErr_SetString(PyExc_ValueError, "Failed to parse arguments");
+		return NULL;
+	}
+	
+	if(hashlen != 20)
+	{
+		PyErr_SetString(PyExc_ValueError, "ID must be 20 bytes");
+		return NULL;
+	}
+	
+	if(dht->s >= 0)
+	{
+		rc = dht_sample(target, AF_INET, callback_search, self);
+		if(rc == -1)
+		{
+			Py_RETURN_FALSE;
+		}
+	}
+	if(dht->s6 >= 0)
+	{
+		rc = dht_sample(target, AF_INET6, callback_search, self);
+		if(rc == -1)
+		{
+			Py_RETURN_FALSE;
+		}
+	}
+	
+	Py_RETURN_TRUE;
+}
+
+static PyObject* JCDHT_cancel(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	DHT *dht = self->dht;
+	unsigned char *infohash;
+	int hashlen, rc, found = 0;
+	
+#if PY_MAJOR_VERSION < 3
+	rc = PyArg_ParseTuple(args, "s#", &infohash, &hashlen);
+#else
+	rc = PyArg_ParseTuple(args, "y#", &infohash, &hashlen);
+#endif
+
+	if(!rc)
+	{
+		PyErr_SetString(PyExc_ValueError, "Failed to parse arguments");
+		return NULL;
+	}
+	
+	if(hashlen != 20)
+	{
+		PyErr_SetString(PyExc_ValueError, "ID must be 20 bytes");
+		return NULL;
+	}
+	
+	if(dht->s >= 0)
+		found |= dht_search_cancel(infohash, AF_INET);
+	if(dht->s6 >= 0)
+		found |= dht_search_cancel(infohash, AF_INET6);
+	
+	if(found)
+	{
+		Py_RETURN_TRUE;
+	}
+	Py_RETURN_FALSE;
+}
+
+static PyObject* JCDHT_search_many(JCDHT* self, PyObject* args)
+{
+	CHECK_DHT(self);
+	
+	DHT *dht = self->dht;
+	PyObject *hashes, *seq;
+	unsigned char *ids;
+	Py_ssize_t i, n;
+	int rc, queued = 0, port = 0;
+	
+	rc = PyArg_ParseTuple(args, "O|i", &hashes, &port);
+	if(!rc)
+	{
+		PyErr_SetString(PyExc_ValueError, "Failed to parse arguments");
+		return NULL;
+	}
+	
+	if(port < 0 || port >= 0x10000)
+	{
+		PyErr_SetString(PyExc_ValueError, "Wrong port value");
+		return NULL;
+	}
+	
+	seq = PySequence_Fast(hashes, "Expected a sequence of infohashes");
+	if(seq == NULL)
+		return NULL;
+	
+	n = PySequence_Fast_GET_SIZE(seq);
+	ids = malloc(n * 20 + 1);
+	if(ids == NULL)
+	{
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+	
+	for(i = 0; i < n; i++)
+	{
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+		char *hash;
+		Py_ssize_t hashlen;
+		
+		if(!PyBytes_Check(item) ||
+		   PyBytes_AsStringAndSize(item, &hash, &hashlen) < 0 ||
+		   hashlen != 20)
+		{
+			free(ids);
+			Py_DECREF(seq);
+			PyErr_SetString(PyExc_ValueError, "ID must be 20 bytes");
+			return NULL;
+		}
+		memcpy(ids + i * 20, hash, 20);
+	}
+	Py_DECREF(seq);
+	
+	if(n > 0 && dht->s >= 0)
+	{
+		rc = dht_search_many(ids, n, port, AF_INET);
+		if(rc > queued)
+			queued = rc;
+	}
+	if(n > 0 && dht->s6 >= 0)
+	{
+		rc = dht_search_many(ids, n, port, AF_INET6);
+		if(rc > queued)
+			queued = rc;
+	}
+	free(ids);
+	
+	return PyLong_FromLong(queued);
+}
+
 static PyObject* JCDHT_new(PyTypeObject *type, PyObject* args, PyObject* kwds)
 {
 	JCDHT* self = (JCDHT*)type->tp_alloc(type, 0);
@@ -700,13 +1288,48 @@ PyMethodDef DHT_methods[] =
 		"it will be inserted, up to 9 nodes can be inserted for every call of do()."
 	},
 	{
-		"search", (PyCFunction)JCDHT_search, METH_VARARGS,
-		"search(infohash, port)\n"
+		"search", (PyCFunction)JCDHT_search, METH_VARARGS | METH_KEYWORDS,
+		"search(infohash, port, max_peers, priority)\n"
 		"Starts a search, up to 1024 searches can be in progress at a given time.\n"
 		"Port is optional, if set to something different than 0 it will announce the peer to the network,\n"
 		"and the port will represent the TCP socket used by the client.\n"
+		"If max_peers is set and port is 0, the search stops as soon as that many distinct peers are found.\n"
+		"Searches with a higher priority are the first to send requests when the\n"
+		"number of requests in flight reaches OPT_SEARCH_BUDGET, the default priority is 0.\n"
 		"Return false if max number of searches is reached."
 	},
+	{
+		"scrape", (PyCFunction)JCDHT_scrape, METH_VARARGS,
+		"scrape(infohash)\n"
+		"Estimates the size of the swarm of infohash from the bloom filters (BEP 33)\n"
+		"of the nodes closest to it, without fetching any peers.  When done, on_search\n"
+		"is called with EVENT_SCRAPE and a tuple (seeds, peers) of estimated counts.\n"
+		"Return false if max number of searches is reached."
+	},
+	{
+		"sample", (PyCFunction)JCDHT_sample, METH_VARARGS,
+		"sample(target)\n"
+		"Walks towards target asking the nodes on the way for samples of the infohashes\n"
+		"they store (BEP 51).  Each reply with samples calls on_search with EVENT_SAMPLES\n"
+		"and a list of 20 bytes infohashes, the end of the walk with EVENT_SEARCH_DONE.\n"
+		"Picking random targets covers the whole keyspace.\n"
+		"Return false if max number of searches is reached."
+	},
+	{
+		"cancel", (PyCFunction)JCDHT_cancel, METH_VARARGS,
+		"cancel(infohash)\n"
+		"Stops the search for infohash, including one queued by search_many().\n"
+		"No further on_search events are reported for it.\n"
+		"Return false if there was no such search."
+	},
+	{
+		"search_many", (PyCFunction)JCDHT_search_many, METH_VARARGS,
+		"search_many(infohashes, port)\n"
+		"Queues a search for every infohash in the sequence, port is as in search().\n"
+		"Searches are started from do() in keyspace order, at a rate set with\n"
+		"OPT_SEARCH_RATE, and reuse the nodes found by searches for nearby hashes.\n"
+		"Return the number of searches queued, up to 65536 can be pending."
+	},
 	{
 		"nodes", (PyCFunction)JCDHT_nodes, METH_VARARGS,
 		"nodes(family)\n"
@@ -720,6 +1343,89 @@ PyMethodDef DHT_methods[] =
 		"get_nodes()\n"
 		"Return a tuple like (peerlist, peerlist6)."
 	},
+	{
+		"set_option", (PyCFunction)JCDHT_set_option, METH_VARARGS,
+		"set_option(option, value)\n"
+		"Change a tunable of the DHT, option is one of the DHT.OPT_* constants:\n"
+		"OPT_MIN_TIMEOUT and OPT_MAX_TIMEOUT bound the time in milliseconds we wait\n"
+		"for a reply, which is otherwise derived from the observed round-trip times,\n"
+		"OPT_SEARCH_ALPHA and OPT_SEARCH_MAX_ALPHA bound the number of get_peers\n"
+		"requests that a search keeps in flight; a lower bound above its upper\n"
+		"bound is refused, so raise the upper bound first,\n"
+		"OPT_SEARCH_REPLY_DRIVEN, if set to 1, makes every reply immediately advance\n"
+		"its search, which then completes as soon as the 8 closest nodes have replied,\n"
+		"OPT_SEARCH_BATCH is the minimum interval in milliseconds between two calls\n"
+		"of on_search with new peers for the same search, 0 for no batching,\n"
+		"OPT_SEARCH_RATE is the number of searches queued by search_many()\n"
+		"started per second,\n"
+		"OPT_SEARCH_BUDGET is the number of get_peers requests that all searches\n"
+		"together may keep in flight, 0 for no limit,\n"
+		"OPT_SEARCH_CACHE_TTL is the number of seconds during which a search for the\n"
+		"same infohash is answered at once with the peers of the last completed one,\n"
+		"0 (the default) disables this,\n"
+		"OPT_SEARCH_CACHE_REFRESH, if set to 1, makes such an answer also refresh the\n"
+		"cached peers in the background once they are older than half the TTL,\n"
+		"OPT_STORAGE_BUDGET is the number of bytes we spend on peers announced to us,\n"
+		"OPT_MAX_HASHES and OPT_MAX_PEERS bound the number of infohashes we store\n"
+		"and the number of peers per infohash and address family; once a limit is\n"
+		"reached the least recently queried infohashes make room for new ones,\n"
+		"OPT_REQUEST_RATE is the number of incoming requests per second we answer,\n"
+		"OPT_PREFIX_RATE and OPT_ANNOUNCE_RATE are the number of requests and of\n"
+		"announces per second we accept from a single /24 or /64, 0 for no limit;\n"
+		"each limit allows bursts of 4 seconds' worth,\n"
+		"OPT_SHED_LOAD is how full, in percent, the receive queue of a socket must be\n"
+		"before find_node and sample_infohashes requests are dropped, get_peers and\n"
+		"ping follow halfway to a full queue, replies and announces are never dropped;\n"
+		"0 never drops anything, the default is 50,\n"
+		"OPT_SEND_RATE is the number of packets per second we send, 0 (the default)\n"
+		"for no limit; packets over the limit are queued and paced out, replies first,\n"
+		"then searches, then routing table maintenance."
+	},
+	{
+		"get_option", (PyCFunction)JCDHT_get_option, METH_VARARGS,
+		"get_option(option)\n"
+		"Return the current value of a tunable, see set_option()."
+	},
+	{
+		"blocklist", (PyCFunction)JCDHT_blocklist, METH_VARARGS,
+		"blocklist(records, family)\n"
+		"Adds addresses and ranges to the blocklist, nothing is sent to or accepted from them.\n"
+		"Records is a bytes-like object, such as a mmap of a file, of packed records each made\n"
+		"of an address in network byte order and a prefix length byte, 5 bytes per record\n"
+		"for DHT.IPV4 (the default family) and 17 bytes for DHT.IPV6.\n"
+		"The blocklist is shared by every DHT object of the process.\n"
+		"With DHT.FILTER, the widest 800 IPv4 ranges are also dropped by the kernel.\n"
+		"Return the number of records added."
+	},
+	{
+		"blocklist_clear", (PyCFunction)JCDHT_blocklist_clear, METH_NOARGS,
+		"blocklist_clear()\n"
+		"Empties the blocklist."
+	},
+	{
+		"blocklist_count", (PyCFunction)JCDHT_blocklist_count, METH_NOARGS,
+		"blocklist_count()\n"
+		"Return a tuple with the number of single addresses and of merged ranges in the blocklist."
+	},
+	{
+		"blocked", (PyCFunction)JCDHT_blocked, METH_VARARGS,
+		"blocked(address)\n"
+		"Return True if the blocklist holds address, an IPv4 or IPv6 address string."
+	},
+	{
+		"stats", (PyCFunction)JCDHT_stats, METH_NOARGS,
+		"stats()\n"
+		"Return a dict mapping each type of incoming message, 'reply', 'ping', 'find_node',\n"
+		"'get_peers', 'announce_peer' and 'sample_infohashes', to a tuple with the number\n"
+		"received, dropped by rate limiting and dropped because of load (see OPT_SHED_LOAD)."
+	},
+	{
+		"send_stats", (PyCFunction)JCDHT_send_stats, METH_NOARGS,
+		"send_stats()\n"
+		"Return a dict mapping each class of outgoing packets, 'reply', 'search' and\n"
+		"'maintenance', to a tuple with the number sent, queued for later because of\n"
+		"OPT_SEND_RATE or a full socket buffer, and dropped."
+	},
 	{
 		"dump", (PyCFunction)JCDHT_dump, METH_NOARGS,
 		"dump()\n"
@@ -759,6 +1465,9 @@ PyTypeObject JCDHTType = {
 	"Id is the 20 byte DHT peer id, port is the port used for listening.\n"
 	"Sockflags and bind_addr are optional.\n"
 	"Sockflags defines the networks stack to use, default is (DHT.IPV6 | DHT.IPV4) aka both.\n"
+	"Adding DHT.FILTER attaches a BPF filter to the sockets (Linux only), which drops\n"
+	"oversized or non-bencoded datagrams and martian or blocklisted IPv4 sources\n"
+	"before they reach the process.\n"
 	"Bind addr can be used to listen on a specific network interface, default is all interfaces."
 	"",                        /* tp_doc */
 	0,                         /* tp_traverse */
@@ -793,8 +1502,29 @@ void JCDHT_install_dict()
 	SET(EVENT_VALUES6)
 	SET(EVENT_SEARCH_DONE)
 	SET(EVENT_SEARCH_DONE6)
+	SET(EVENT_SCRAPE)
+	SET(EVENT_SAMPLES)
 	SET(IPV4)
 	SET(IPV6)
+	SET(FILTER)
+	SET(OPT_MIN_TIMEOUT)
+	SET(OPT_MAX_TIMEOUT)
+	SET(OPT_SEARCH_ALPHA)
+	SET(OPT_SEARCH_MAX_ALPHA)
+	SET(OPT_SEARCH_REPLY_DRIVEN)
+	SET(OPT_SEARCH_BATCH)
+	SET(OPT_SEARCH_RATE)
+	SET(OPT_SEARCH_BUDGET)
+	SET(OPT_SEARCH_CACHE_TTL)
+	SET(OPT_SEARCH_CACHE_REFRESH)
+	SET(OPT_STORAGE_BUDGET)
+	SET(OPT_MAX_HASHES)
+	SET(OPT_MAX_PEERS)
+	SET(OPT_REQUEST_RATE)
+	SET(OPT_PREFIX_RATE)
+	SET(OPT_ANNOUNCE_RATE)
+	SET(OPT_SHED_LOAD)
+	SET(OPT_SEND_RATE)
 
 #undef SET
 
@@ -15,6 +15,8 @@ typedef struct {
 	unsigned char myid[20];
 	time_t tosleep;
 	int ipv4, ipv6;
+	int filter;
+	uint32_t prng;
 } DHT;
 
 typedef struct {
@@ -26,10 +28,17 @@ void JCDHT_install_dict(void);
 
 enum {
 	DHT_IPV4 = 1,
-	DHT_IPV6 = 2
+	DHT_IPV6 = 2,
+	DHT_FILTER = 4
 };
 
 #define DHT_GET_NODES_MAX 500
 
+/* Larger datagrams would be truncated by JCDHT_do. */
+#define DHT_RECV_SIZE 4096
+
+/* Datagrams read by a single call of JCDHT_do under load. */
+#define DHT_RECV_BATCH 16
+
 #endif /* CORE_H */
 
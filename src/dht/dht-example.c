@@ -1,9 +1,6 @@
 /* This example code was written by Juliusz Chroboczek.
    You are free to cut'n'paste from it to your heart's content. */
 
-/* For crypt */
-#define _GNU_SOURCE
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -345,17 +342,16 @@ main(int argc, char **argv)
         if(rc > 0) {
             fromlen = sizeof(from);
             if(s >= 0 && FD_ISSET(s, &readfds))
-                rc = recvfrom(s, buf, sizeof(buf) - 1, 0,
+                rc = recvfrom(s, buf, sizeof(buf), 0,
                               (struct sockaddr*)&from, &fromlen);
             else if(s6 >= 0 && FD_ISSET(s6, &readfds))
-                rc = recvfrom(s6, buf, sizeof(buf) - 1, 0,
+                rc = recvfrom(s6, buf, sizeof(buf), 0,
                               (struct sockaddr*)&from, &fromlen);
             else
                 abort();
         }
 
         if(rc > 0) {
-            buf[rc] = '\0';
             rc = dht_periodic(buf, rc, (struct sockaddr*)&from, fromlen,
                               &tosleep, callback, NULL);
         } else {
@@ -417,50 +413,6 @@ dht_blacklisted(const struct sockaddr *sa, int salen)
     return 0;
 }
 
-/* We need to provide a reasonably strong cryptographic hashing function.
-   Here's how we'd do it if we had RSA's MD5 code. */
-#if 0
-void
-dht_hash(void *hash_return, int hash_size,
-         const void *v1, int len1,
-         const void *v2, int len2,
-         const void *v3, int len3)
-{
-    static MD5_CTX ctx;
-    MD5Init(&ctx);
-    MD5Update(&ctx, v1, len1);
-    MD5Update(&ctx, v2, len2);
-    MD5Update(&ctx, v3, len3);
-    MD5Final(&ctx);
-    if(hash_size > 16)
-        memset((char*)hash_return + 16, 0, hash_size - 16);
-    memcpy(hash_return, ctx.digest, hash_size > 16 ? 16 : hash_size);
-}
-#else
-/* But for this example, we might as well use something weaker. */
-void
-dht_hash(void *hash_return, int hash_size,
-         const void *v1, int len1,
-         const void *v2, int len2,
-         const void *v3, int len3)
-{
-    const char *c1 = v1, *c2 = v2, *c3 = v3;
-    char key[9];                /* crypt is limited to 8 characters */
-    int i;
-
-    memset(key, 0, 9);
-#define CRYPT_HAPPY(c) ((c % 0x60) + 0x20)
-
-    for(i = 0; i < 2 && i < len1; i++)
-        key[i] = CRYPT_HAPPY(c1[i]);
-    for(i = 0; i < 4 && i < len1; i++)
-        key[2 + i] = CRYPT_HAPPY(c2[i]);
-    for(i = 0; i < 2 && i < len1; i++)
-        key[6 + i] = CRYPT_HAPPY(c3[i]);
-    strncpy(hash_return, crypt(key, "jc"), hash_size);
-}
-#endif
-
 int
 dht_random_bytes(void *buf, size_t size)
 {
@@ -28,11 +28,13 @@ THE SOFTWARE.
    gratuitious changes to the coding style.  And please send back any
    improvements to the author. */
 
-/* For memmem. */
-#define _GNU_SOURCE
+/* For timerclear, timerisset and timercmp, which glibc hides when
+   compiling with a strict -std. */
+#define _DEFAULT_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
@@ -53,12 +55,6 @@ THE SOFTWARE.
 
 #include "dht.h"
 
-#ifndef HAVE_MEMMEM
-#ifdef __GLIBC__
-#define HAVE_MEMMEM
-#endif
-#endif
-
 #ifndef MSG_CONFIRM
 #define MSG_CONFIRM 0
 #endif
@@ -78,11 +74,6 @@ set_nonblocking(int fd, int nonblocking)
     return (rc == 0 ? 0 : -1);
 }
 
-static int
-random(void)
-{
-    return rand();
-}
 extern const char *inet_ntop(int, const void *, char *, socklen_t);
 
 #else
@@ -134,6 +125,8 @@ struct node {
     time_t reply_time;          /* time of last correct reply received */
     time_t pinged_time;         /* time of last request */
     int pinged;                 /* how many requests we sent since last reply */
+    int rtt;                    /* smoothed round-trip time in ms, or 0 */
+    int rttvar;                 /* round-trip time variation in ms */
     struct node *next;
 };
 
@@ -152,49 +145,114 @@ struct search_node {
     unsigned char id[20];
     struct sockaddr_storage ss;
     int sslen;
-    time_t request_time;        /* the time of the last unanswered request */
+    struct timeval request_time; /* the time of the last unanswered request */
     time_t reply_time;          /* the time of the last reply */
     int pinged;
+    int rto;                    /* reply timeout (ms), 0 if unknown */
     unsigned char token[40];
     int token_len;
     int replied;                /* whether we have received a reply */
     int acked;                  /* whether they acked our announcement */
 };
 
+/* A set of peers in compact format, kept in order of insertion and
+   indexed by an open-addressing hash table.  All peers in a set have
+   the same length, 6 for IPv4 and 18 for IPv6. */
+struct peerset {
+    unsigned char *peers;
+    int numpeers, maxpeers;
+    unsigned short *index;      /* peer numbers plus one, 0 for empty slots */
+    int indexsize;              /* a power of two */
+};
+
 /* When performing a search, we search for up to SEARCH_NODES closest nodes
    to the destination, and use the additional ones to backtrack if any of
    the target 8 turn out to be dead. */
 #define SEARCH_NODES 14
 
+/* The number of other searches, those with the closest targets, that
+   the nodes of a reply are offered to. */
+#define SEARCH_SHARE 8
+
+/* The maximum number of distinct peers we remember for a search. */
+#ifndef DHT_MAX_SEARCH_PEERS
+#define DHT_MAX_SEARCH_PEERS 2048
+#endif
+
 struct search {
     unsigned short tid;
     int af;
-    time_t step_time;           /* the time of the last search_step */
+    struct timeval step_time;   /* the time of the last search_step */
     unsigned char id[20];
     unsigned short port;        /* 0 for pure searches */
     int done;
     struct search_node nodes[SEARCH_NODES];
     int numnodes;
+    int alpha;                  /* the number of requests kept in flight */
+    int rtt, rttvar;            /* smoothed round-trip time of replies */
+    struct peerset peers, peers6; /* the peers found so far */
+    int delivered, delivered6;  /* how many of those were passed on */
+    struct timeval deliver_time; /* the time we last passed peers on */
+    int max_peers;              /* stop after this many peers, 0 for all */
+    int priority;               /* higher priority searches send first */
+    int starved;                /* held back by the budget */
+    int cancelled;
+    time_t cache_time;          /* when the peers were complete, or 0 */
+    int quiet;                  /* refreshing the cache, report nothing */
+    int kind;                   /* SEARCH_PEERS, _SCRAPE or _SAMPLE */
+    unsigned char *bloom;       /* BFsd then BFpe, for scrapes */
     struct search *next;
 };
 
-struct peer {
-    time_t time;
-    unsigned char ip[16];
-    unsigned short len;
-    unsigned short port;
-};
+/* What a search is after: peers, the bloom filters of BEP 33, or the
+   infohashes sampled by the nodes close to its target (BEP 51). */
+#define SEARCH_PEERS 0
+#define SEARCH_SCRAPE 1
+#define SEARCH_SAMPLE 2
 
-/* The maximum number of peers we store for a given hash. */
+/* The maximum number of peers we store for a given hash and address
+   family. */
 #ifndef DHT_MAX_PEERS
 #define DHT_MAX_PEERS 2048
 #endif
 
+#if DHT_MAX_PEERS > 65535 || DHT_MAX_SEARCH_PEERS > 65535
+#error "Peer sets are indexed by 16-bit peer numbers"
+#endif
+
+/* The number of seconds after which we suggest that a node asking for
+   samples of our storage asks again. */
+#ifndef DHT_SAMPLE_INTERVAL
+#define DHT_SAMPLE_INTERVAL 60
+#endif
+
+/* The size we keep our replies to get_peers within, so that they fit in
+   a single packet even over IPv6. */
+#ifndef DHT_REPLY_SIZE
+#define DHT_REPLY_SIZE 1200
+#endif
+
+/* Stored peers carry a 15-bit timestamp with a resolution of
+   PEER_TIME_RES seconds, which wraps around after a day and a half.
+   Peers expire long before that.  The top bit is set for seeds. */
+#define PEER_TIME_RES 4
+#define PEER_SEED 0x8000
+
+/* The size of each of the BEP 33 bloom filters, of seeds and of peers. */
+#define BLOOM_SIZE 256
+
 /* The maximum number of hashes we're willing to track. */
 #ifndef DHT_MAX_HASHES
 #define DHT_MAX_HASHES 16384
 #endif
 
+/* The default number of bytes we're willing to spend on stored peers.
+   Once either limit is reached, the least recently queried hashes are
+   evicted to make room for new announces. */
+#ifndef DHT_STORAGE_BUDGET
+#define DHT_STORAGE_BUDGET (16 * 1024 * 1024)
+#endif
+
 /* The maximum number of searches we keep data about. */
 #ifndef DHT_MAX_SEARCHES
 #define DHT_MAX_SEARCHES 1024
@@ -205,16 +263,101 @@ struct peer {
 #define DHT_SEARCH_EXPIRE_TIME (62 * 60)
 #endif
 
+/* The peers of a storage entry as a run of bencoded strings, ready to be
+   copied into the values list of a reply. */
+struct values {
+    unsigned char *data;
+    int len;                    /* -1 if it needs to be rebuilt */
+    int max;
+};
+
 struct storage {
     unsigned char id[20];
-    int numpeers, maxpeers;
-    struct peer *peers;
-    struct storage *next;
+    struct peerset peers, peers6; /* compact 6 and 18 octet peers */
+    unsigned short *times, *times6; /* when each peer was last announced */
+    struct values values, values6;
+    unsigned char *bloom;       /* BFsd then BFpe for scrapes */
+    int bloom_valid;
+    size_t size;                /* bytes allocated for this entry */
+    int pos;                    /* in storage_array */
+    struct storage *prev, *next; /* most recently queried first */
+};
+
+/* Every request we send is recorded in a transaction, which allows us
+   to match replies exactly and to measure round-trip times. */
+struct transaction {
+    unsigned char tid[4];
+    unsigned char id[20];       /* the node we queried, zeroes if unknown */
+    struct sockaddr_storage ss;
+    int sslen;                  /* 0 for unused slots */
+    struct timeval time;        /* the time the request was sent */
+    unsigned short sid;         /* the search this request belongs to */
+};
+
+/* The number of requests we keep track of.  Slots are reused in a
+   round-robin fashion, skipping those that are still waiting for a
+   reply, so this must be a power of two no larger than 65536.  A request
+   that gets no reply holds its slot for max_timeout, so this should be
+   comfortably larger than the number of requests we send in that time,
+   or we will refuse to send any more. */
+#ifndef DHT_MAX_TRANSACTIONS
+#define DHT_MAX_TRANSACTIONS 4096
+#endif
+
+/* Default bounds on the time we wait for a reply before sending a request
+   to another node, in milliseconds.  We use the upper bound when we have
+   no idea of the round-trip time.  These can be changed at runtime with
+   dht_set_option. */
+#ifndef DHT_MIN_TIMEOUT
+#define DHT_MIN_TIMEOUT 500
+#endif
+
+#ifndef DHT_MAX_TIMEOUT
+#define DHT_MAX_TIMEOUT 15000
+#endif
+
+/* Default bounds on the number of get_peers requests that a search keeps
+   in flight.  A search starts with the lower bound, and widens whenever
+   requests time out. */
+#ifndef DHT_SEARCH_ALPHA
+#define DHT_SEARCH_ALPHA 3
+#endif
+
+#ifndef DHT_SEARCH_MAX_ALPHA
+#define DHT_SEARCH_MAX_ALPHA 8
+#endif
+
+/* The default number of get_peers requests that all searches together
+   may keep in flight, 0 for no limit.  Searches with a higher priority
+   are served first. */
+#ifndef DHT_SEARCH_BUDGET
+#define DHT_SEARCH_BUDGET 256
+#endif
+
+/* Searches submitted in bulk with dht_search_many are queued in keyspace
+   order, and started at a rate of DHT_SEARCH_RATE per second. */
+struct pending_search {
+    unsigned char id[20];
+    unsigned short port;
+    int af;
 };
 
+#ifndef DHT_MAX_PENDING_SEARCHES
+#define DHT_MAX_PENDING_SEARCHES 65536
+#endif
+
+#ifndef DHT_SEARCH_RATE
+#define DHT_SEARCH_RATE 50
+#endif
+
 static struct storage * find_storage(const unsigned char *id);
+static unsigned char *storage_bloom(struct storage *st);
 static void flush_search_node(struct search_node *n, struct search *sr);
+static int search_undelivered(struct search *sr);
 
+static void send_flush(void);
+static int send_wakeup(struct timeval *tv_return);
+static void send_queues_clear(void);
 static int send_ping(const struct sockaddr *sa, int salen,
                      const unsigned char *tid, int tid_len);
 static int send_pong(const struct sockaddr *sa, int salen,
@@ -226,16 +369,23 @@ static int send_nodes_peers(const struct sockaddr *sa, int salen,
                             const unsigned char *tid, int tid_len,
                             const unsigned char *nodes, int nodes_len,
                             const unsigned char *nodes6, int nodes6_len,
-                            int af, struct storage *st,
+                            int af, struct storage *st, int scrape,
+                            int sample,
                             const unsigned char *token, int token_len);
 static int send_closest_nodes(const struct sockaddr *sa, int salen,
                               const unsigned char *tid, int tid_len,
                               const unsigned char *id, int want,
-                              int af, struct storage *st,
+                              int af, struct storage *st, int scrape,
+                              int sample,
                               const unsigned char *token, int token_len);
 static int send_get_peers(const struct sockaddr *sa, int salen,
                           unsigned char *tid, int tid_len,
-                          unsigned char *infohash, int want, int confirm);
+                          unsigned char *infohash, int want, int scrape,
+                          int confirm);
+static int send_sample_infohashes(const struct sockaddr *sa, int salen,
+                                  unsigned char *tid, int tid_len,
+                                  unsigned char *target, int want,
+                                  int confirm);
 static int send_announce_peer(const struct sockaddr *sa, int salen,
                               unsigned char *tid, int tid_len,
                               unsigned char *infohas, unsigned short port,
@@ -252,22 +402,43 @@ static int send_error(const struct sockaddr *sa, int salen,
 #define FIND_NODE 3
 #define GET_PEERS 4
 #define ANNOUNCE_PEER 5
+#define SAMPLE_INFOHASHES 6
 
 #define WANT4 1
 #define WANT6 2
 
+/* The parts of an incoming message that we care about.  Fields that are
+   absent from the message are zero, except want, which is -1.  Strings
+   of variable length are not copied: they point into the buffer that
+   was parsed, and have length 0 when absent. */
+struct message {
+    unsigned char tid[16];
+    int tid_len;
+    unsigned char id[20];
+    unsigned char info_hash[20];
+    unsigned char target[20];
+    unsigned short port;
+    const unsigned char *token;
+    int token_len;
+    const unsigned char *nodes, *nodes6;
+    int nodes_len, nodes6_len;
+    /* The contents of the values list, still bencoded. */
+    const unsigned char *values;
+    int values_len;
+    int numvalues, numvalues6;
+    int want;
+    int scrape, seed;
+    const unsigned char *bfsd, *bfpe; /* NULL when absent */
+    const unsigned char *samples;
+    int samples_len;
+};
+
 static int parse_message(const unsigned char *buf, int buflen,
-                         unsigned char *tid_return, int *tid_len,
-                         unsigned char *id_return,
-                         unsigned char *info_hash_return,
-                         unsigned char *target_return,
-                         unsigned short *port_return,
-                         unsigned char *token_return, int *token_len,
-                         unsigned char *nodes_return, int *nodes_len,
-                         unsigned char *nodes6_return, int *nodes6_len,
-                         unsigned char *values_return, int *values_len,
-                         unsigned char *values6_return, int *values6_len,
-                         int *want_return);
+                         struct message *m);
+static const unsigned char *bstring(const unsigned char *p,
+                                    const unsigned char *end,
+                                    const unsigned char **s_return,
+                                    int *len_return);
 
 static const unsigned char zeroes[20] = {0};
 static const unsigned char ones[20] = {
@@ -282,25 +453,62 @@ static const unsigned char v4prefix[16] = {
 static int dht_socket = -1;
 static int dht_socket6 = -1;
 
-static time_t search_time;
+static struct timeval search_time;
+static struct timeval wakeup_time;
+
+static int min_timeout = DHT_MIN_TIMEOUT;
+static int max_timeout = DHT_MAX_TIMEOUT;
+static int search_alpha = DHT_SEARCH_ALPHA;
+static int search_max_alpha = DHT_SEARCH_MAX_ALPHA;
+static int search_reply_driven = 0;
+static int search_batch = 0;
+static int search_rate = DHT_SEARCH_RATE;
+static int search_budget = DHT_SEARCH_BUDGET;
+static int search_cache_ttl = 0;
+static int search_cache_refresh = 0;
+static unsigned int hash_seed;
+static uint64_t prng_state[2];
 static time_t confirm_nodes_time;
 static time_t rotate_secrets_time;
 
 static unsigned char myid[20];
-static int have_v = 0;
-static unsigned char my_v[9];
-static unsigned char secret[8];
-static unsigned char oldsecret[8];
+/* Every message we send starts with "d1:ad2:id20:" or "d1:rd2:id20:"
+   followed by our id, and ends with our version, if any, followed by
+   the type of the message. */
+static unsigned char query_head[32], reply_head[32];
+static unsigned char query_tail[16], reply_tail[16], error_tail[16];
+static int tail_len;
+/* SipHash keys. */
+static unsigned char secret[16];
+static unsigned char oldsecret[16];
 
 static struct bucket *buckets = NULL;
 static struct bucket *buckets6 = NULL;
-static struct storage *storage;
+static struct storage *storage, *storage_tail;
 static int numstorage;
+static size_t storage_bytes;
+static int storage_budget = DHT_STORAGE_BUDGET;
+static int storage_max_hashes = DHT_MAX_HASHES;
+static int storage_max_peers = DHT_MAX_PEERS;
+static struct storage **storage_index; /* open addressing, keyed by id */
+static int storage_index_size;  /* a power of two, or 0 */
+static struct storage **storage_array; /* every entry, densely packed */
+static int storage_array_size;
 
 static struct search *searches = NULL;
 static int numsearches;
+static int numinflight = -1;    /* get_peers in flight, -1 if unknown */
+static int search_starved;      /* some search is held back */
+
+static struct pending_search *pending = NULL;
+static int firstpending, numpending, maxpending;
+static int pending_credit;      /* in thousandths of a search */
+static struct timeval pending_time;
 static unsigned short search_id;
 
+static struct transaction transactions[DHT_MAX_TRANSACTIONS];
+static unsigned short transaction_id;
+
 /* The maximum number of nodes that we snub.  There is probably little
    reason to increase this value. */
 #ifndef DHT_MAX_BLACKLISTED
@@ -313,10 +521,129 @@ static struct timeval now;
 static time_t mybucket_grow_time, mybucket6_grow_time;
 static time_t expire_stuff_time;
 
-#define MAX_TOKEN_BUCKET_TOKENS 400
+/* The number of nodes or peers examined by each step of a sweep. */
+#ifndef DHT_EXPIRE_SLICE
+#define DHT_EXPIRE_SLICE 256
+#endif
+
+/* The delay between two steps of a sweep, in milliseconds. */
+#ifndef DHT_EXPIRE_INTERVAL
+#define DHT_EXPIRE_INTERVAL 10
+#endif
+
+#define EXPIRE_IDLE 0
+#define EXPIRE_BUCKETS 1
+#define EXPIRE_BUCKETS6 2
+#define EXPIRE_STORAGE 3
+#define EXPIRE_SEARCHES 4
+
+static int expire_phase = EXPIRE_IDLE;
+static struct bucket *expire_bucket_cursor;
+static struct storage *expire_storage_cursor;
+static struct search **expire_search_cursor;
+
+/* Incoming requests are rate-limited globally, at DHT_REQUEST_RATE per
+   second with bursts of RATE_BURST seconds' worth, and also per source
+   prefix (a /24 or a /64), so that a single crawler cannot use up the
+   global budget.  Announces have a separate, lower per-prefix limit. */
+
+#ifndef DHT_REQUEST_RATE
+#define DHT_REQUEST_RATE 100
+#endif
+
+#ifndef DHT_PREFIX_RATE
+#define DHT_PREFIX_RATE 20
+#endif
+
+#ifndef DHT_ANNOUNCE_RATE
+#define DHT_ANNOUNCE_RATE 2
+#endif
+
+#define RATE_BURST 4
+
+static int request_rate = DHT_REQUEST_RATE;
 static time_t token_bucket_time;
 static int token_bucket_tokens;
 
+/* The per-prefix buckets are cells of a sketch of two rows, indexed by
+   independent bits of the hash of the prefix.  A request must find a
+   token in both of its cells: as with a count-min sketch, collisions
+   can only make the limit stricter, never let an abuser through.  Each
+   cell holds the time, in microseconds, at which its bucket would be
+   full again, which makes refilling implicit. */
+
+#define RATE_CELLS 2048
+
+struct rate_limit {
+    int rate;                   /* per second, 0 for no limit */
+    int64_t cells[2][RATE_CELLS];
+};
+
+static struct rate_limit prefix_limit = {.rate = DHT_PREFIX_RATE};
+static struct rate_limit announce_limit = {.rate = DHT_ANNOUNCE_RATE};
+
+/* Load shedding.  The caller tells us how full its receive queue is,
+   in percent.  Past shed_load, we first drop the requests that cost us
+   the most and matter least, find_node and sample_infohashes, then,
+   halfway to a full queue, get_peers and ping.  Replies, which drive
+   our own searches, and announce_peer are never shed.  Shedding comes
+   before rate limiting, so shed requests use up no tokens. */
+
+#ifndef DHT_SHED_LOAD
+#define DHT_SHED_LOAD 50
+#endif
+
+static int shed_load = DHT_SHED_LOAD;
+static int load;
+
+struct message_stats {
+    unsigned long received, limited, shed;
+};
+
+static struct message_stats message_stats[SAMPLE_INFOHASHES + 1];
+
+/* Outbound pacing.  With a send rate set, each packet must find a token
+   in a bucket that holds SEND_BURST milliseconds' worth, or at least
+   one.  Packets that find none, or that the kernel refuses for lack of
+   buffer space, wait in the queue of their class.  The queues are
+   drained by weighted round robin, so replies get the largest share of
+   the budget and maintenance the smallest without anyone starving.
+   Packets that find their queue full or wait for longer than
+   SEND_QUEUE_AGE are dropped, and so are the transactions of the
+   requests among them. */
+
+#ifndef DHT_SEND_RATE
+#define DHT_SEND_RATE 0
+#endif
+
+#define SEND_BURST 20
+#define SEND_QUEUE_LEN 128
+#define SEND_QUEUE_AGE 1000
+#define SEND_CLASSES 3
+
+static const int send_weight[SEND_CLASSES] = {4, 2, 1};
+
+struct outbound {
+    struct timeval time;
+    struct sockaddr_storage ss;
+    int sslen, flags;
+    unsigned char tid[4];       /* of our request, if tid_len is not 0 */
+    int tid_len;
+    size_t len;
+    unsigned char buf[];
+};
+
+struct send_queue {
+    struct outbound *packets[SEND_QUEUE_LEN];
+    int first, count;
+    int credit;
+    unsigned long sent, deferred, dropped;
+};
+
+static int send_rate = DHT_SEND_RATE;
+static int64_t send_next;       /* as in prefix_bucket */
+static struct send_queue send_queues[SEND_CLASSES];
+
 FILE *dht_debug = NULL;
 
 #ifdef __GNUC__
@@ -352,6 +679,68 @@ print_hex(FILE *f, const unsigned char *buf, int buflen)
         fprintf(f, "%02x", buf[i]);
 }
 
+/* Milliseconds elapsed between tv and now.  Unset times are very old. */
+static int
+msecs_since(const struct timeval *tv)
+{
+    time_t s = now.tv_sec - tv->tv_sec;
+    if(s >= 24 * 60 * 60)
+        return 24 * 60 * 60 * 1000;
+    return s * 1000 + (now.tv_usec - tv->tv_usec) / 1000;
+}
+
+static void
+add_msecs(struct timeval *tv_return, const struct timeval *tv, int msecs)
+{
+    tv_return->tv_sec = tv->tv_sec + msecs / 1000;
+    tv_return->tv_usec = tv->tv_usec + (msecs % 1000) * 1000;
+    if(tv_return->tv_usec >= 1000000) {
+        tv_return->tv_sec++;
+        tv_return->tv_usec -= 1000000;
+    }
+}
+
+/* Whether two addresses designate the same endpoint.  Unlike memcmp,
+   this ignores padding and the IPv6 flow label. */
+static int
+same_address(const struct sockaddr *sa1, const struct sockaddr *sa2)
+{
+    if(sa1->sa_family != sa2->sa_family)
+        return 0;
+
+    switch(sa1->sa_family) {
+    case AF_INET: {
+        struct sockaddr_in *sin1 = (struct sockaddr_in*)sa1;
+        struct sockaddr_in *sin2 = (struct sockaddr_in*)sa2;
+        return sin1->sin_port == sin2->sin_port &&
+            memcmp(&sin1->sin_addr, &sin2->sin_addr, 4) == 0;
+    }
+    case AF_INET6: {
+        struct sockaddr_in6 *sin61 = (struct sockaddr_in6*)sa1;
+        struct sockaddr_in6 *sin62 = (struct sockaddr_in6*)sa2;
+        return sin61->sin6_port == sin62->sin6_port &&
+            memcmp(&sin61->sin6_addr, &sin62->sin6_addr, 16) == 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+/* A xorshift128+ generator, seeded by dht_init, for all the randomness
+   that need not be secret: jitter, sampling and picking nodes.  Secrets
+   come from dht_random_bytes. */
+static unsigned int
+dht_random(void)
+{
+    uint64_t s1 = prng_state[0];
+    const uint64_t s0 = prng_state[1];
+
+    prng_state[0] = s0;
+    s1 ^= s1 << 23;
+    prng_state[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+    return (prng_state[1] + s0) >> 33;
+}
+
 static int
 is_martian(const struct sockaddr *sa)
 {
@@ -454,6 +843,146 @@ xorcmp(const unsigned char *id1, const unsigned char *id2,
     return 0;
 }
 
+/* A seeded hash, used to index the data that remote nodes can choose. */
+static unsigned int
+hash_bytes(const unsigned char *data, int len)
+{
+    unsigned int h = 2166136261U ^ hash_seed;
+    int i;
+    for(i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 16777619;
+    }
+    return h;
+}
+
+/* Return the number of a peer in a set, or -1 if it isn't there. */
+static int
+peerset_find(struct peerset *ps, const unsigned char *peer, int len)
+{
+    unsigned int i, mask;
+
+    if(ps->indexsize == 0)
+        return -1;
+
+    mask = ps->indexsize - 1;
+    i = hash_bytes(peer, len) & mask;
+    while(ps->index[i] != 0) {
+        int k = ps->index[i] - 1;
+        if(memcmp(ps->peers + k * len, peer, len) == 0)
+            return k;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+static void
+peerset_index(struct peerset *ps, int k, int len)
+{
+    unsigned int mask = ps->indexsize - 1;
+    unsigned int i = hash_bytes(ps->peers + k * len, len) & mask;
+    while(ps->index[i] != 0)
+        i = (i + 1) & mask;
+    ps->index[i] = k + 1;
+}
+
+/* Add a peer to a set.  Returns 1 if the peer is new, 0 if it was
+   already there, and -1 if the set is full or we ran out of memory. */
+static int
+peerset_add(struct peerset *ps, const unsigned char *peer, int len, int max)
+{
+    int k;
+
+    if(peerset_find(ps, peer, len) >= 0)
+        return 0;
+
+    if(ps->numpeers >= max)
+        return -1;
+
+    if(ps->numpeers >= ps->maxpeers) {
+        unsigned char *new_peers;
+        int n = ps->maxpeers == 0 ? 8 : 2 * ps->maxpeers;
+        n = MIN(n, max);
+        new_peers = realloc(ps->peers, n * len);
+        if(new_peers == NULL)
+            return -1;
+        ps->peers = new_peers;
+        ps->maxpeers = n;
+    }
+
+    /* Keep the load factor of the index below one half. */
+    if(2 * (ps->numpeers + 1) > ps->indexsize) {
+        unsigned short *new_index;
+        int n = ps->indexsize == 0 ? 16 : 2 * ps->indexsize;
+        new_index = calloc(n, sizeof(unsigned short));
+        if(new_index == NULL)
+            return -1;
+        free(ps->index);
+        ps->index = new_index;
+        ps->indexsize = n;
+        for(k = 0; k < ps->numpeers; k++)
+            peerset_index(ps, k, len);
+    }
+
+    memcpy(ps->peers + ps->numpeers * len, peer, len);
+    peerset_index(ps, ps->numpeers, len);
+    ps->numpeers++;
+    return 1;
+}
+
+/* Remove peer k from the index, with backward-shift deletion so that
+   lookups never need tombstones. */
+static void
+peerset_unindex(struct peerset *ps, int k, int len)
+{
+    unsigned int i, j, h, mask = ps->indexsize - 1;
+
+    i = hash_bytes(ps->peers + k * len, len) & mask;
+    while(ps->index[i] != k + 1) {
+        if(ps->index[i] == 0)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    j = i;
+    while(1) {
+        ps->index[i] = 0;
+        do {
+            j = (j + 1) & mask;
+            if(ps->index[j] == 0)
+                return;
+            h = hash_bytes(ps->peers + (ps->index[j] - 1) * len, len) & mask;
+            /* Leave the entry alone if its home slot lies cyclically
+               in (i, j]. */
+        } while(i <= j ? (i < h && h <= j) : (i < h || h <= j));
+        ps->index[i] = ps->index[j];
+        i = j;
+    }
+}
+
+/* Remove peer k from a set, replacing it with the last one. */
+static void
+peerset_remove(struct peerset *ps, int k, int len)
+{
+    int last = ps->numpeers - 1;
+
+    peerset_unindex(ps, k, len);
+    if(k != last) {
+        peerset_unindex(ps, last, len);
+        memcpy(ps->peers + k * len, ps->peers + last * len, len);
+        peerset_index(ps, k, len);
+    }
+    ps->numpeers--;
+}
+
+static void
+peerset_clear(struct peerset *ps)
+{
+    free(ps->peers);
+    free(ps->index);
+    memset(ps, 0, sizeof(struct peerset));
+}
+
 /* We keep buckets in a sorted linked list.  A bucket b ranges from
    b->first inclusive up to b->next->first exclusive. */
 static int
@@ -516,23 +1045,64 @@ find_node(const unsigned char *id, int af)
     return NULL;
 }
 
-/* Return a random node in a bucket. */
+/* Update a smoothed round-trip time with a new sample, in the manner
+   of RFC 6298.  A smoothed rtt of 0 means that we have no samples yet. */
+static void
+update_rtt(int *rtt, int *rttvar, int sample)
+{
+    sample = MAX(sample, 1);
+    if(*rtt == 0) {
+        *rtt = sample;
+        *rttvar = sample / 2;
+    } else {
+        *rttvar = (3 * *rttvar + abs(*rtt - sample)) / 4;
+        *rtt = MAX((7 * *rtt + sample) / 8, 1);
+    }
+}
+
+/* The time we're willing to wait for a reply, given a smoothed
+   round-trip time. */
+static int
+compute_rto(int rtt, int rttvar)
+{
+    if(rtt == 0)
+        return max_timeout;
+    return MIN(MAX(rtt + 4 * rttvar, min_timeout), max_timeout);
+}
+
+static int
+node_rto(struct node *n)
+{
+    return compute_rto(n->rtt, n->rttvar);
+}
+
+/* Return a random node in a bucket.  We pick two nodes at random and
+   keep the faster one, which favours fast nodes without starving the
+   others. */
 static struct node *
 random_node(struct bucket *b)
 {
-    struct node *n;
-    int nn;
+    struct node *n, *n1 = NULL, *n2 = NULL;
+    int nn1, nn2, i;
 
     if(b->count == 0)
         return NULL;
 
-    nn = random() % b->count;
+    nn1 = dht_random() % b->count;
+    nn2 = dht_random() % b->count;
     n = b->nodes;
-    while(nn > 0 && n) {
+    i = 0;
+    while(n) {
+        if(i == nn1)
+            n1 = n;
+        if(i == nn2)
+            n2 = n;
         n = n->next;
-        nn--;
+        i++;
     }
-    return n;
+    if(n1 == NULL || n2 == NULL)
+        return n1 ? n1 : n2;
+    return node_rto(n2) < node_rto(n1) ? n2 : n1;
 }
 
 /* Return the middle id of a bucket. */
@@ -567,9 +1137,9 @@ bucket_random(struct bucket *b, unsigned char *id_return)
 
     memcpy(id_return, b->first, bit / 8);
     id_return[bit / 8] = b->first[bit / 8] & (0xFF00 >> (bit % 8));
-    id_return[bit / 8] |= random() & 0xFF >> (bit % 8);
+    id_return[bit / 8] |= dht_random() & 0xFF >> (bit % 8);
     for(i = bit / 8 + 1; i < 20; i++)
-        id_return[i] = random() & 0xFF;
+        id_return[i] = dht_random() & 0xFF;
     return 1;
 }
 
@@ -600,7 +1170,7 @@ node_good(struct node *node)
 
 /* Our transaction-ids are 4-bytes long, with the first two bytes identi-
    fying the kind of request, and the remaining two a sequence number in
-   host order. */
+   host order, which indexes the transaction table. */
 
 static void
 make_tid(unsigned char *tid_return, const char *prefix, unsigned short seqno)
@@ -622,6 +1192,69 @@ tid_match(const unsigned char *tid, const char *prefix,
         return 0;
 }
 
+/* Allocate a transaction for a request that we're about to send, and
+   return its transaction id in tid_return.  The sequence number of the
+   tid indexes the transaction table.  Returns -1 if every slot is held
+   by a request that might still get a reply. */
+static int
+new_transaction(unsigned char *tid_return, const char *prefix,
+                const unsigned char *id,
+                const struct sockaddr *sa, int salen, unsigned short sid)
+{
+    unsigned short seqno;
+    struct transaction *t;
+    int i;
+
+    if((unsigned)salen > sizeof(struct sockaddr_storage))
+        abort();
+
+    for(i = 0; i < DHT_MAX_TRANSACTIONS; i++) {
+        seqno = transaction_id++;
+        t = &transactions[seqno % DHT_MAX_TRANSACTIONS];
+        if(t->sslen == 0 || msecs_since(&t->time) >= max_timeout)
+            break;
+    }
+    if(i >= DHT_MAX_TRANSACTIONS) {
+        debugf("Transaction table full.\n");
+        return -1;
+    }
+
+    make_tid(tid_return, prefix, seqno);
+    memcpy(t->tid, tid_return, 4);
+    if(id)
+        memcpy(t->id, id, 20);
+    else
+        memset(t->id, 0, 20);
+    memcpy(&t->ss, sa, salen);
+    t->sslen = salen;
+    t->time = now;
+    t->sid = sid;
+    return 0;
+}
+
+/* Find the transaction that a reply belongs to.  The reply must carry
+   the exact tid that we sent, and come from the address and, if we knew
+   it, the node id that we sent the request to. */
+static struct transaction *
+find_transaction(const unsigned char *tid, int tid_len,
+                 const unsigned char *id, const struct sockaddr *from)
+{
+    unsigned short seqno;
+    struct transaction *t;
+
+    if(tid_len != 4)
+        return NULL;
+
+    memcpy(&seqno, tid + 2, 2);
+    t = &transactions[seqno % DHT_MAX_TRANSACTIONS];
+    if(t->sslen == 0 || memcmp(t->tid, tid, 4) != 0 ||
+       !same_address((struct sockaddr*)&t->ss, from))
+        return NULL;
+    if(id && id_cmp(t->id, zeroes) != 0 && id_cmp(t->id, id) != 0)
+        return NULL;
+    return t;
+}
+
 /* Every bucket caches the address of a likely node.  Ping it. */
 static int
 send_cached_ping(struct bucket *b)
@@ -633,7 +1266,9 @@ send_cached_ping(struct bucket *b)
         return 0;
 
     debugf("Sending ping to cached node.\n");
-    make_tid(tid, "pn", 0);
+    if(new_transaction(tid, "pn", NULL,
+                       (struct sockaddr*)&b->cached, b->cachedlen, 0) < 0)
+        return -1;
     rc = send_ping((struct sockaddr*)&b->cached, b->cachedlen, tid, 4);
     b->cached.ss_family = 0;
     b->cachedlen = 0;
@@ -821,11 +1456,15 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
                 if(n->pinged_time < now.tv_sec - 15) {
                     unsigned char tid[4];
                     debugf("Sending ping to dubious node.\n");
-                    make_tid(tid, "pn", 0);
-                    send_ping((struct sockaddr*)&n->ss, n->sslen,
-                              tid, 4);
-                    n->pinged++;
-                    n->pinged_time = now.tv_sec;
+                    if(new_transaction(tid, "pn", n->id,
+                                       (struct sockaddr*)&n->ss,
+                                       n->sslen, 0) < 0)
+                        break;
+                    if(send_ping((struct sockaddr*)&n->ss, n->sslen,
+                                 tid, 4) >= 0) {
+                        n->pinged++;
+                        n->pinged_time = now.tv_sec;
+                    }
                     break;
                 }
             }
@@ -876,54 +1515,52 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
 
 /* Called periodically to purge known-bad nodes.  Note that we're very
    conservative here: broken nodes in the table don't do much harm, we'll
-   recover as soon as we find better ones. */
+   recover as soon as we find better ones.  Returns the number of nodes
+   examined. */
 static int
-expire_buckets(struct bucket *b)
+expire_bucket(struct bucket *b)
 {
-    while(b) {
-        struct node *n, *p;
-        int changed = 0;
+    struct node *n, *p;
+    int work = 1 + b->count;
+    int changed = 0;
 
-        while(b->nodes && b->nodes->pinged >= 4) {
-            n = b->nodes;
-            b->nodes = n->next;
+    while(b->nodes && b->nodes->pinged >= 4) {
+        n = b->nodes;
+        b->nodes = n->next;
+        b->count--;
+        changed = 1;
+        free(n);
+    }
+
+    p = b->nodes;
+    while(p) {
+        while(p->next && p->next->pinged >= 4) {
+            n = p->next;
+            p->next = n->next;
             b->count--;
             changed = 1;
             free(n);
         }
+        p = p->next;
+    }
 
-        p = b->nodes;
-        while(p) {
-            while(p->next && p->next->pinged >= 4) {
-                n = p->next;
-                p->next = n->next;
-                b->count--;
-                changed = 1;
-                free(n);
-            }
-            p = p->next;
-        }
-
-        if(changed)
-            send_cached_ping(b);
+    if(changed)
+        send_cached_ping(b);
 
-        b = b->next;
-    }
-    expire_stuff_time = now.tv_sec + 120 + random() % 240;
-    return 1;
+    return work;
 }
 
 /* While a search is in progress, we don't necessarily keep the nodes being
    walked in the main bucket table.  A search in progress is identified by
-   a unique transaction id, a short (and hence small enough to fit in the
-   transaction id of the protocol packets). */
+   a unique id, a short, which is recorded in the transactions of the
+   requests that we send on its behalf. */
 
 static struct search *
 find_search(unsigned short tid, int af)
 {
     struct search *sr = searches;
     while(sr) {
-        if(sr->tid == tid && sr->af == af)
+        if(sr->tid == tid && sr->af == af && !sr->cancelled)
             return sr;
         sr = sr->next;
     }
@@ -935,10 +1572,10 @@ find_search(unsigned short tid, int af)
    discard it. */
 
 static int
-insert_search_node(unsigned char *id,
+insert_search_node(const unsigned char *id,
                    const struct sockaddr *sa, int salen,
                    struct search *sr, int replied,
-                   unsigned char *token, int token_len)
+                   const unsigned char *token, int token_len, int rto)
 {
     struct search_node *n;
     int i, j;
@@ -976,10 +1613,12 @@ found:
     memcpy(&n->ss, sa, salen);
     n->sslen = salen;
 
+    if(rto > 0)
+        n->rto = rto;
     if(replied) {
         n->replied = 1;
         n->reply_time = now.tv_sec;
-        n->request_time = 0;
+        timerclear(&n->request_time);
         n->pinged = 0;
     }
     if(token) {
@@ -1003,53 +1642,170 @@ flush_search_node(struct search_node *n, struct search *sr)
     sr->numnodes--;
 }
 
+/* Expire the search at *srp, or release its peers if they can no longer
+   be used to answer from the cache. */
 static void
-expire_searches(void)
+expire_search(struct search **srp)
 {
-    struct search *sr = searches, *previous = NULL;
+    struct search *sr = *srp;
 
-    while(sr) {
-        struct search *next = sr->next;
-        if(sr->step_time < now.tv_sec - DHT_SEARCH_EXPIRE_TIME) {
-            if(previous)
-                previous->next = next;
-            else
-                searches = next;
-            free(sr);
-            numsearches--;
-        } else {
-            previous = sr;
-        }
-        sr = next;
+    if(sr->step_time.tv_sec < now.tv_sec - DHT_SEARCH_EXPIRE_TIME) {
+        *srp = sr->next;
+        peerset_clear(&sr->peers);
+        peerset_clear(&sr->peers6);
+        free(sr->bloom);
+        free(sr);
+        numsearches--;
+    } else if(sr->done && !search_undelivered(sr) &&
+              (search_cache_ttl <= 0 ||
+               sr->cache_time < now.tv_sec - search_cache_ttl)) {
+        peerset_clear(&sr->peers);
+        peerset_clear(&sr->peers6);
+        sr->delivered = 0;
+        sr->delivered6 = 0;
+        sr->cache_time = 0;
     }
 }
 
-/* This must always return 0 or 1, never -1, not even on failure (see below). */
+/* The time we wait for replies to a search.  This is derived from the
+   replies that the search has received so far. */
 static int
-search_send_get_peers(struct search *sr, struct search_node *n)
+search_rto(struct search *sr)
 {
-    struct node *node;
-    unsigned char tid[4];
-
-    if(n == NULL) {
-        int i;
-        for(i = 0; i < sr->numnodes; i++) {
-            if(sr->nodes[i].pinged < 3 && !sr->nodes[i].replied &&
-               sr->nodes[i].request_time < now.tv_sec - 15)
-                n = &sr->nodes[i];
-        }
-    }
+    return compute_rto(sr->rtt, sr->rttvar);
+}
 
-    if(!n || n->pinged >= 3 || n->replied ||
-       n->request_time >= now.tv_sec - 15)
-        return 0;
+/* Whether the last request to a search node has had enough time to be
+   answered.  Nodes with a known round-trip time time out early, the
+   others use the round-trip time of the search. */
+static int
+search_node_timedout(struct search *sr, struct search_node *n)
+{
+    return msecs_since(&n->request_time) >= (n->rto ? n->rto : search_rto(sr));
+}
+
+/* The number of get_peers requests of a search that are in flight. */
+static int
+search_inflight(struct search *sr)
+{
+    int i, inflight = 0;
+    for(i = 0; i < sr->numnodes; i++) {
+        struct search_node *n = &sr->nodes[i];
+        if(n->pinged < 3 && !n->replied && timerisset(&n->request_time) &&
+           !search_node_timedout(sr, n))
+            inflight++;
+    }
+    return inflight;
+}
+
+/* How many more get_peers requests all searches may send right now.  The
+   count of requests in flight is recomputed once per dht_periodic. */
+static int
+search_budget_left(void)
+{
+    struct search *sr;
+
+    if(search_budget <= 0)
+        return 1;
+
+    if(numinflight < 0) {
+        numinflight = 0;
+        for(sr = searches; sr; sr = sr->next)
+            numinflight += search_inflight(sr);
+    }
+    return search_budget - numinflight;
+}
+
+/* A request that we sent was dropped by our own send queues.  Close its
+   transaction and, if uncount is set, take back the ping that it was
+   counted as, so that the node is not held responsible. */
+static void
+transaction_dropped(const unsigned char *tid, const struct sockaddr *sa,
+                    int uncount)
+{
+    struct transaction *t;
+    struct search *sr;
+    struct node *node;
+    int i;
+
+    t = find_transaction(tid, 4, NULL, sa);
+    if(t == NULL)
+        return;
+    t->sslen = 0;
+
+    if(!uncount || id_cmp(t->id, zeroes) == 0)
+        return;
+
+    node = find_node(t->id, sa->sa_family);
+    if(node && node->pinged > 0)
+        node->pinged--;
+
+    if(tid_match(tid, "gp", NULL) || tid_match(tid, "ap", NULL)) {
+        sr = find_search(t->sid, sa->sa_family);
+        if(sr == NULL)
+            return;
+        for(i = 0; i < sr->numnodes; i++) {
+            if(id_cmp(sr->nodes[i].id, t->id) == 0) {
+                if(sr->nodes[i].pinged > 0)
+                    sr->nodes[i].pinged--;
+                break;
+            }
+        }
+        numinflight = -1;
+    }
+}
+
+/* This must always return 0 or 1, never -1, not even on failure (see below). */
+static int
+search_send_get_peers(struct search *sr, struct search_node *n)
+{
+    struct node *node;
+    unsigned char tid[4];
+    int rc;
+
+    if(n == NULL) {
+        int i;
+        for(i = 0; i < sr->numnodes; i++) {
+            if(sr->nodes[i].pinged < 3 && !sr->nodes[i].replied &&
+               search_node_timedout(sr, &sr->nodes[i]))
+                n = &sr->nodes[i];
+        }
+    }
+
+    if(!n || n->pinged >= 3 || n->replied || !search_node_timedout(sr, n))
+        return 0;
+
+    if(search_budget_left() <= 0) {
+        sr->starved = 1;
+        search_starved = 1;
+        return 0;
+    }
+
+    /* The previous request timed out.  Slow nodes shouldn't stall the
+       search, so keep more requests in flight. */
+    if(timerisset(&n->request_time) &&
+       sr->alpha < MAX(search_alpha, search_max_alpha))
+        sr->alpha++;
 
     debugf("Sending get_peers.\n");
-    make_tid(tid, "gp", sr->tid);
-    send_get_peers((struct sockaddr*)&n->ss, n->sslen, tid, 4, sr->id, -1,
-                   n->reply_time >= now.tv_sec - 15);
+    if(new_transaction(tid, "gp", n->id,
+                       (struct sockaddr*)&n->ss, n->sslen, sr->tid) < 0)
+        return 0;
+    if(sr->kind == SEARCH_SAMPLE)
+        rc = send_sample_infohashes((struct sockaddr*)&n->ss, n->sslen,
+                                    tid, 4, sr->id, -1,
+                                    n->reply_time >= now.tv_sec - 15);
+    else
+        rc = send_get_peers((struct sockaddr*)&n->ss, n->sslen, tid, 4,
+                            sr->id, -1, sr->kind == SEARCH_SCRAPE,
+                            n->reply_time >= now.tv_sec - 15);
+    /* We dropped it ourselves, the node has done nothing wrong. */
+    if(rc < 0)
+        return 0;
     n->pinged++;
-    n->request_time = now.tv_sec;
+    n->request_time = now;
+    if(numinflight >= 0)
+        numinflight++;
     /* If the node happens to be in our main routing table, mark it
        as pinged. */
     node = find_node(n->id, n->ss.ss_family);
@@ -1057,13 +1813,162 @@ search_send_get_peers(struct search *sr, struct search_node *n)
     return 1;
 }
 
+/* Remember the peers of a values list, and return how many were new. */
+static int
+add_search_peers(struct search *sr,
+                 const unsigned char *values, int values_len, int len)
+{
+    struct peerset *ps = len == 6 ? &sr->peers : &sr->peers6;
+    int i, rc, n = 0;
+
+    for(i = 0; i + len <= values_len; i += len) {
+        rc = peerset_add(ps, values + i, len, DHT_MAX_SEARCH_PEERS);
+        if(rc > 0)
+            n++;
+    }
+    return n;
+}
+
+/* The same, for the strings of a values list as they were received. */
+static int
+add_search_values(struct search *sr,
+                  const unsigned char *values, int values_len)
+{
+    const unsigned char *p = values, *end = values + values_len, *s;
+    int len, rc, n = 0;
+
+    while(p < end) {
+        p = bstring(p, end, &s, &len);
+        if(p == NULL)
+            break;
+        if(len != 6 && len != 18)
+            continue;
+        rc = peerset_add(len == 6 ? &sr->peers : &sr->peers6, s, len,
+                         DHT_MAX_SEARCH_PEERS);
+        if(rc > 0)
+            n++;
+    }
+    return n;
+}
+
+static int
+search_undelivered(struct search *sr)
+{
+    return sr->peers.numpeers > sr->delivered ||
+        sr->peers6.numpeers > sr->delivered6;
+}
+
+/* Pass on the peers that the callback hasn't seen yet, in one batch
+   per address family. */
+static void
+deliver_search_peers(struct search *sr, dht_callback *callback, void *closure)
+{
+    int n = sr->peers.numpeers, n6 = sr->peers6.numpeers;
+    int d = sr->delivered, d6 = sr->delivered6;
+
+    sr->delivered = n;
+    sr->delivered6 = n6;
+    sr->deliver_time = now;
+
+    if(callback && !sr->quiet) {
+        if(n > d)
+            (*callback)(closure, DHT_EVENT_VALUES, sr->id,
+                        (void*)(sr->peers.peers + d * 6), (n - d) * 6);
+        /* The callback might have restarted the search. */
+        if(n6 > d6 && sr->peers6.numpeers >= n6)
+            (*callback)(closure, DHT_EVENT_VALUES6, sr->id,
+                        (void*)(sr->peers6.peers + d6 * 18), (n6 - d6) * 18);
+    }
+}
+
+static void
+schedule_search(const struct timeval *tv)
+{
+    if(!timerisset(&search_time) || timercmp(tv, &search_time, <))
+        search_time = *tv;
+}
+
+/* Whether a pure search has found as many peers as it was asked for.
+   Searches that announce always run until the announce is done. */
+static int
+search_satisfied(struct search *sr)
+{
+    return sr->port == 0 && sr->max_peers > 0 &&
+        sr->peers.numpeers + sr->peers6.numpeers >= sr->max_peers;
+}
+
+static void
+finish_search(struct search *sr, dht_callback *callback, void *closure)
+{
+    int quiet = sr->quiet;
+
+    deliver_search_peers(sr, callback, closure);
+    sr->done = 1;
+    sr->quiet = 0;
+    if(sr->port == 0 && sr->kind == SEARCH_PEERS)
+        sr->cache_time = now.tv_sec;
+    if(callback && !quiet) {
+        if(sr->kind == SEARCH_SCRAPE)
+            (*callback)(closure, DHT_EVENT_SCRAPE, sr->id,
+                        sr->bloom, 2 * BLOOM_SIZE);
+        else
+            (*callback)(closure,
+                        sr->af == AF_INET ?
+                        DHT_EVENT_SEARCH_DONE : DHT_EVENT_SEARCH_DONE6,
+                        sr->id, NULL, 0);
+    }
+    sr->step_time = now;
+}
+
+/* Whether the peers of a completed search are recent enough to answer a
+   new search for at most max_peers peers, 0 meaning all of them. */
+static int
+search_cached(struct search *sr, int max_peers)
+{
+    if(search_cache_ttl <= 0 || sr->cache_time == 0 || sr->cancelled ||
+       sr->cache_time < now.tv_sec - search_cache_ttl)
+        return 0;
+    /* A search that stopped early can only answer smaller requests. */
+    return sr->max_peers == 0 ||
+        (max_peers > 0 &&
+         sr->peers.numpeers + sr->peers6.numpeers >= max_peers);
+}
+
+/* Report all the cached peers of a search, as if it had just completed. */
+static void
+answer_from_cache(struct search *sr, dht_callback *callback, void *closure)
+{
+    int quiet = sr->quiet;
+
+    debugf("Answering search from cache.\n");
+    sr->quiet = 0;
+    sr->delivered = 0;
+    sr->delivered6 = 0;
+    deliver_search_peers(sr, callback, closure);
+    if(callback)
+        (*callback)(closure,
+                    sr->af == AF_INET ?
+                    DHT_EVENT_SEARCH_DONE : DHT_EVENT_SEARCH_DONE6,
+                    sr->id, NULL, 0);
+    sr->quiet = quiet;
+}
+
 /* When a search is in progress, we periodically call search_step to send
-   further requests. */
+   further requests.  We keep sr->alpha requests in flight, and the
+   interval between steps is the time we wait for replies.  In reply-driven
+   mode, search_step is also called on every reply, so that the timer only
+   serves to detect timeouts. */
 static void
 search_step(struct search *sr, dht_callback *callback, void *closure)
 {
-    int i, j;
+    int i, j, rc;
     int all_done = 1;
+    int inflight;
+
+    if(search_satisfied(sr)) {
+        finish_search(sr, callback, closure);
+        return;
+    }
 
     /* Check if the first 8 live nodes have replied. */
     j = 0;
@@ -1080,7 +1985,8 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
 
     if(all_done) {
         if(sr->port == 0) {
-            goto done;
+            finish_search(sr, callback, closure);
+            return;
         } else {
             int all_acked = 1;
             j = 0;
@@ -1096,49 +2002,42 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
                    a positive reply is just as good --, let's deal with it. */
                 if(n->token_len == 0)
                     n->acked = 1;
-                if(!n->acked) {
+                if(!n->acked)
                     all_acked = 0;
+                if(!n->acked && search_node_timedout(sr, n)) {
                     debugf("Sending announce_peer.\n");
-                    make_tid(tid, "ap", sr->tid);
-                    send_announce_peer((struct sockaddr*)&n->ss,
-                                       sizeof(struct sockaddr_storage),
-                                       tid, 4, sr->id, sr->port,
-                                       n->token, n->token_len,
-                                       n->reply_time >= now.tv_sec - 15);
-                    n->pinged++;
-                    n->request_time = now.tv_sec;
-                    node = find_node(n->id, n->ss.ss_family);
-                    if(node) pinged(node, NULL);
+                    if(new_transaction(tid, "ap", n->id,
+                                       (struct sockaddr*)&n->ss, n->sslen,
+                                       sr->tid) < 0)
+                        return;
+                    rc = send_announce_peer((struct sockaddr*)&n->ss,
+                                            sizeof(struct sockaddr_storage),
+                                            tid, 4, sr->id, sr->port,
+                                            n->token, n->token_len,
+                                            n->reply_time >= now.tv_sec - 15);
+                    if(rc >= 0) {
+                        n->pinged++;
+                        n->request_time = now;
+                        node = find_node(n->id, n->ss.ss_family);
+                        if(node) pinged(node, NULL);
+                    }
                 }
                 j++;
             }
-            if(all_acked)
-                goto done;
+            if(all_acked) {
+                finish_search(sr, callback, closure);
+                return;
+            }
         }
-        sr->step_time = now.tv_sec;
-        return;
-    }
-
-    if(sr->step_time + 15 >= now.tv_sec)
+        sr->step_time = now;
         return;
-
-    j = 0;
-    for(i = 0; i < sr->numnodes; i++) {
-        j += search_send_get_peers(sr, &sr->nodes[i]);
-        if(j >= 3)
-            break;
     }
-    sr->step_time = now.tv_sec;
-    return;
 
- done:
-    sr->done = 1;
-    if(callback)
-        (*callback)(closure,
-                    sr->af == AF_INET ?
-                    DHT_EVENT_SEARCH_DONE : DHT_EVENT_SEARCH_DONE6,
-                    sr->id, NULL, 0);
-    sr->step_time = now.tv_sec;
+    sr->starved = 0;
+    inflight = search_inflight(sr);
+    for(i = 0; i < sr->numnodes && inflight < sr->alpha; i++)
+        inflight += search_send_get_peers(sr, &sr->nodes[i]);
+    sr->step_time = now;
 }
 
 static struct search *
@@ -1150,13 +2049,15 @@ new_search(void)
     sr = searches;
     while(sr) {
         if(sr->done &&
-           (oldest == NULL || oldest->step_time > sr->step_time))
+           (oldest == NULL ||
+            timercmp(&oldest->step_time, &sr->step_time, >)))
             oldest = sr;
         sr = sr->next;
     }
 
     /* The oldest slot is expired. */
-    if(oldest && oldest->step_time < now.tv_sec - DHT_SEARCH_EXPIRE_TIME)
+    if(oldest &&
+       oldest->step_time.tv_sec < now.tv_sec - DHT_SEARCH_EXPIRE_TIME)
         return oldest;
 
     /* Allocate a new slot. */
@@ -1182,68 +2083,171 @@ insert_search_bucket(struct bucket *b, struct search *sr)
     n = b->nodes;
     while(n) {
         insert_search_node(n->id, (struct sockaddr*)&n->ss, n->sslen,
-                           sr, 0, NULL, 0);
+                           sr, 0, NULL, 0, n->rtt ? node_rto(n) : 0);
         n = n->next;
     }
 }
 
+/* Seed a search with the live nodes of the search whose target is
+   closest to ours.  Bulk searches are started in keyspace order, so
+   that search has usually converged next to our target already. */
+static void
+insert_search_neighbour(struct search *sr)
+{
+    struct search *s, *nb = NULL;
+    int i, bits = -1;
+
+    for(s = searches; s; s = s->next) {
+        int b;
+        if(s == sr || s->af != sr->af || s->numnodes == 0)
+            continue;
+        b = common_bits(s->id, sr->id);
+        if(b > bits) {
+            bits = b;
+            nb = s;
+        }
+    }
+
+    if(nb == NULL)
+        return;
+
+    for(i = 0; i < nb->numnodes; i++) {
+        struct search_node *n = &nb->nodes[i];
+        if(!n->replied || n->pinged >= 3 ||
+           n->reply_time < now.tv_sec - 7200)
+            continue;
+        insert_search_node(n->id, (struct sockaddr*)&n->ss, n->sslen,
+                           sr, 0, NULL, 0, n->rto);
+    }
+}
+
+/* Find the searches that the nodes learnt by sr are worth offering to,
+   at most SEARCH_SHARE of them.  A node shares no more bits with another
+   target than the two targets share with each other, so skip searches
+   whose list is full of nodes closer than that, and prefer those whose
+   target is closest to that of sr.  This is done once per reply. */
+static int
+share_searches(struct search *sr, struct search **share)
+{
+    struct search *s;
+    int bits[SEARCH_SHARE];
+    int b, j, n = 0;
+
+    for(s = searches; s; s = s->next) {
+        if(s == sr || s->done || s->af != sr->af)
+            continue;
+        b = common_bits(sr->id, s->id);
+        if(s->numnodes >= SEARCH_NODES &&
+           b < common_bits(s->nodes[s->numnodes - 1].id, s->id))
+            continue;
+        if(n >= SEARCH_SHARE && b <= bits[n - 1])
+            continue;
+        if(n < SEARCH_SHARE)
+            n++;
+        for(j = n - 1; j > 0 && bits[j - 1] < b; j--) {
+            share[j] = share[j - 1];
+            bits[j] = bits[j - 1];
+        }
+        share[j] = s;
+        bits[j] = b;
+    }
+    return n;
+}
+
+/* Offer a node to the searches found by share_searches.  A node that is
+   no closer than the last one of a full list is skipped without
+   scanning it. */
+static void
+share_search_node(struct search **share, int numshare,
+                  const unsigned char *id,
+                  const struct sockaddr *sa, int salen)
+{
+    struct search *s;
+    int i;
+
+    for(i = 0; i < numshare; i++) {
+        s = share[i];
+        if(s->numnodes >= SEARCH_NODES &&
+           xorcmp(id, s->nodes[s->numnodes - 1].id, s->id) >= 0)
+            continue;
+        insert_search_node(id, sa, salen, s, 0, NULL, 0, 0);
+    }
+}
+
+/* Keep the list of searches sorted by decreasing priority, so that
+   higher priority searches are stepped, and hence send, first. */
+static void
+sort_search(struct search *sr)
+{
+    struct search **p;
+
+    for(p = &searches; *p; p = &(*p)->next) {
+        if(*p == sr) {
+            *p = sr->next;
+            break;
+        }
+    }
+
+    p = &searches;
+    while(*p && (*p)->priority > sr->priority)
+        p = &(*p)->next;
+    sr->next = *p;
+    *p = sr;
+}
+
 /* Start a search.  If port is non-zero, perform an announce when the
    search is complete. */
 int
 dht_search(const unsigned char *id, int port, int af,
            dht_callback *callback, void *closure)
+{
+    return dht_search_ext(id, port, af, 0, 0, callback, closure);
+}
+
+static int
+start_search(const unsigned char *id, int port, int af,
+             int max_peers, int priority, int kind,
+             dht_callback *callback, void *closure)
 {
     struct search *sr;
     struct storage *st;
     struct bucket *b = find_bucket(id, af);
+    int refresh = 0;
 
     if(b == NULL) {
         errno = EAFNOSUPPORT;
         return -1;
     }
 
-    /* Try to answer this search locally.  In a fully grown DHT this
-       is very unlikely, but people are running modified versions of
-       this code in private DHTs with very few nodes.  What's wrong
-       with flooding? */
-    if(callback) {
-        st = find_storage(id);
-        if(st) {
-            unsigned short swapped;
-            unsigned char buf[18];
-            int i;
-
-            debugf("Found local data (%d peers).\n", st->numpeers);
-
-            for(i = 0; i < st->numpeers; i++) {
-                swapped = htons(st->peers[i].port);
-                if(st->peers[i].len == 4) {
-                    memcpy(buf, st->peers[i].ip, 4);
-                    memcpy(buf + 4, &swapped, 2);
-                    (*callback)(closure, DHT_EVENT_VALUES, id,
-                                (void*)buf, 6);
-                } else if(st->peers[i].len == 16) {
-                    memcpy(buf, st->peers[i].ip, 16);
-                    memcpy(buf + 16, &swapped, 2);
-                    (*callback)(closure, DHT_EVENT_VALUES6, id,
-                                (void*)buf, 18);
-                }
-            }
-        }
-    }
-
+    /* A scrape or a walk for samples must not take over a search for
+       peers of the same hash, or the reverse, so each kind has its own. */
     sr = searches;
     while(sr) {
-        if(sr->af == af && id_cmp(sr->id, id) == 0)
+        if(sr->af == af && sr->kind == kind && id_cmp(sr->id, id) == 0)
             break;
         sr = sr->next;
     }
 
+    if(sr && port == 0 && kind == SEARCH_PEERS &&
+       search_cached(sr, max_peers)) {
+        answer_from_cache(sr, callback, closure);
+        /* Past half its lifetime, refresh the entry in the background
+           with the parameters of the search that filled it. */
+        if(!search_cache_refresh || !sr->done ||
+           sr->cache_time >= now.tv_sec - search_cache_ttl / 2)
+            return 1;
+        debugf("Refreshing cached search.\n");
+        refresh = 1;
+        max_peers = sr->max_peers;
+        priority = sr->priority;
+    }
+
     if(sr) {
         /* We're reusing data from an old search.  Reusing the same tid
            means that we can merge replies for both searches. */
         int i;
         sr->done = 0;
+        sr->cancelled = 0;
     again:
         for(i = 0; i < sr->numnodes; i++) {
             struct search_node *n;
@@ -1266,13 +2270,63 @@ dht_search(const unsigned char *id, int port, int af,
         }
         sr->af = af;
         sr->tid = search_id++;
-        sr->step_time = 0;
+        timerclear(&sr->step_time);
+        sr->rtt = 0;
+        sr->rttvar = 0;
         memcpy(sr->id, id, 20);
         sr->done = 0;
+        sr->cancelled = 0;
         sr->numnodes = 0;
     }
 
+    if(kind == SEARCH_SCRAPE && sr->bloom == NULL) {
+        sr->bloom = malloc(2 * BLOOM_SIZE);
+        if(sr->bloom == NULL) {
+            sr->done = 1;
+            return -1;
+        }
+    }
+
     sr->port = port;
+    sr->max_peers = max_peers;
+    sr->priority = priority;
+    sort_search(sr);
+    sr->alpha = search_alpha;
+    sr->quiet = refresh;
+    sr->kind = kind;
+    if(kind == SEARCH_SCRAPE)
+        memset(sr->bloom, 0, 2 * BLOOM_SIZE);
+    if(!refresh) {
+        peerset_clear(&sr->peers);
+        peerset_clear(&sr->peers6);
+        sr->delivered = 0;
+        sr->delivered6 = 0;
+        sr->cache_time = 0;
+    }
+    timerclear(&sr->deliver_time);
+
+    /* Try to answer this search locally.  In a fully grown DHT this
+       is very unlikely, but people are running modified versions of
+       this code in private DHTs with very few nodes.  What's wrong
+       with flooding? */
+    if(callback && kind != SEARCH_SAMPLE) {
+        st = find_storage(id);
+        if(st && kind == SEARCH_SCRAPE) {
+            unsigned char *bloom = storage_bloom(st);
+            int i;
+            debugf("Found local data for scrape.\n");
+            for(i = 0; bloom && i < 2 * BLOOM_SIZE; i++)
+                sr->bloom[i] |= bloom[i];
+        } else if(st) {
+            struct peerset *ps = af == AF_INET ? &st->peers : &st->peers6;
+            int len = af == AF_INET ? 6 : 18;
+
+            debugf("Found local data (%d peers).\n", ps->numpeers);
+
+            add_search_peers(sr, ps->peers, ps->numpeers * len, len);
+            deliver_search_peers(sr, callback, closure);
+        }
+    }
 
     insert_search_bucket(b, sr);
 
@@ -1283,136 +2337,802 @@ dht_search(const unsigned char *id, int port, int af,
         if(p)
             insert_search_bucket(p, sr);
     }
-    if(sr->numnodes < SEARCH_NODES)
-        insert_search_bucket(find_bucket(myid, af), sr);
+    if(sr->numnodes < SEARCH_NODES)
+        insert_search_bucket(find_bucket(myid, af), sr);
+
+    insert_search_neighbour(sr);
+
+    search_step(sr, callback, closure);
+    search_time = now;
+    return 1;
+}
+
+/* Start a search that stops once max_peers distinct peers have been
+   found, unless max_peers is 0 or port is non-zero. */
+int
+dht_search_ext(const unsigned char *id, int port, int af,
+               int max_peers, int priority,
+               dht_callback *callback, void *closure)
+{
+    return start_search(id, port, af, max_peers, priority, SEARCH_PEERS,
+                        callback, closure);
+}
+
+/* Estimate the size of a swarm, as per BEP 33.  Instead of peers, the
+   search collects the bloom filters of seeds and of other peers from the
+   nodes close to the hash, and merges them.  They are passed to the
+   callback with DHT_EVENT_SCRAPE once the search is complete. */
+int
+dht_scrape(const unsigned char *id, int af,
+           dht_callback *callback, void *closure)
+{
+    return start_search(id, 0, af, 0, 0, SEARCH_SCRAPE, callback, closure);
+}
+
+/* Walk towards target asking for sample_infohashes (BEP 51).  Every reply
+   carrying samples is passed to the callback with DHT_EVENT_SAMPLES, as
+   a run of 20-octet infohashes. */
+int
+dht_sample(const unsigned char *target, int af,
+           dht_callback *callback, void *closure)
+{
+    return start_search(target, 0, af, 0, 0, SEARCH_SAMPLE,
+                        callback, closure);
+}
+
+/* Stop the searches for id, of every kind, and forget about them.  Late
+   replies are ignored, and no further events are reported. */
+int
+dht_search_cancel(const unsigned char *id, int af)
+{
+    struct search *sr;
+    int i, j, found = 0;
+
+    j = firstpending;
+    for(i = firstpending; i < firstpending + numpending; i++) {
+        if(pending[i].af == af && id_cmp(pending[i].id, id) == 0) {
+            found = 1;
+            continue;
+        }
+        pending[j++] = pending[i];
+    }
+    numpending = j - firstpending;
+
+    for(sr = searches; sr; sr = sr->next) {
+        if(sr->af != af || sr->cancelled || id_cmp(sr->id, id) != 0)
+            continue;
+        sr->done = 1;
+        sr->cancelled = 1;
+        sr->quiet = 0;
+        sr->cache_time = 0;
+        sr->numnodes = 0;
+        peerset_clear(&sr->peers);
+        peerset_clear(&sr->peers6);
+        sr->delivered = 0;
+        sr->delivered6 = 0;
+        /* Make the slot the first to be reused. */
+        timerclear(&sr->step_time);
+        numinflight = -1;
+        found = 1;
+    }
+
+    return found;
+}
+
+static int
+pending_cmp(const void *a, const void *b)
+{
+    const struct pending_search *p1 = a, *p2 = b;
+    int rc = id_cmp(p1->id, p2->id);
+    if(rc != 0)
+        return rc;
+    return p1->af - p2->af;
+}
+
+/* Queue searches for n hashes, stored back to back in ids.  They are
+   started from dht_periodic in keyspace order, so that each can reuse
+   the nodes found by its predecessor. */
+int
+dht_search_many(const unsigned char *ids, int n, int port, int af)
+{
+    int i, j;
+
+    if(find_bucket(zeroes, af) == NULL) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    if(n > DHT_MAX_PENDING_SEARCHES - numpending)
+        n = DHT_MAX_PENDING_SEARCHES - numpending;
+    if(n <= 0) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if(firstpending > 0) {
+        memmove(pending, pending + firstpending,
+                numpending * sizeof(struct pending_search));
+        firstpending = 0;
+    }
+
+    if(numpending + n > maxpending) {
+        struct pending_search *new_pending;
+        int m = maxpending * 2;
+        if(m < numpending + n)
+            m = numpending + n;
+        new_pending = realloc(pending, m * sizeof(struct pending_search));
+        if(new_pending == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        pending = new_pending;
+        maxpending = m;
+    }
+
+    for(i = 0; i < n; i++) {
+        memcpy(pending[numpending + i].id, ids + i * 20, 20);
+        pending[numpending + i].port = port;
+        pending[numpending + i].af = af;
+    }
+
+    qsort(pending, numpending + n, sizeof(struct pending_search),
+          pending_cmp);
+
+    /* Merge duplicates, keeping the announce if any. */
+    j = 0;
+    for(i = 0; i < numpending + n; i++) {
+        if(j > 0 && pending_cmp(&pending[j - 1], &pending[i]) == 0) {
+            if(pending[i].port)
+                pending[j - 1].port = pending[i].port;
+            continue;
+        }
+        pending[j++] = pending[i];
+    }
+    numpending = j;
+
+    search_time = now;
+    return n;
+}
+
+/* Start as many queued searches as the rate limit allows. */
+static void
+start_pending_searches(dht_callback *callback, void *closure)
+{
+    int ms = msecs_since(&pending_time);
+
+    if(ms >= 1000) {
+        pending_credit = 1000 * search_rate;
+        pending_time = now;
+    } else {
+        pending_credit += ms * search_rate;
+        if(pending_credit > 1000 * search_rate)
+            pending_credit = 1000 * search_rate;
+        add_msecs(&pending_time, &pending_time, ms);
+    }
+
+    while(numpending > 0 && pending_credit >= 1000) {
+        struct pending_search *p = &pending[firstpending];
+        int rc = dht_search(p->id, p->port, p->af, callback, closure);
+        if(rc < 0 && errno == ENOSPC)
+            break;
+        firstpending++;
+        numpending--;
+        pending_credit -= 1000;
+    }
+
+    if(numpending == 0) {
+        free(pending);
+        pending = NULL;
+        firstpending = maxpending = 0;
+    }
+}
+
+/* A struct storage stores all the stored peer addresses for a given info
+   hash.  Storage is kept in a list, and indexed by a hash table with
+   linear probing which is never more than half full. */
+
+static struct storage *
+find_storage(const unsigned char *id)
+{
+    unsigned int i, mask;
+
+    if(storage_index_size == 0)
+        return NULL;
+
+    mask = storage_index_size - 1;
+    i = hash_bytes(id, 20) & mask;
+    while(storage_index[i]) {
+        if(id_cmp(id, storage_index[i]->id) == 0)
+            return storage_index[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static void
+storage_index_put(struct storage *st)
+{
+    unsigned int mask = storage_index_size - 1;
+    unsigned int i = hash_bytes(st->id, 20) & mask;
+    while(storage_index[i])
+        i = (i + 1) & mask;
+    storage_index[i] = st;
+}
+
+static int
+storage_index_add(struct storage *st)
+{
+    if(2 * (numstorage + 1) > storage_index_size) {
+        struct storage **old = storage_index;
+        int i, oldsize = storage_index_size;
+        int n = oldsize == 0 ? 64 : 2 * oldsize;
+        storage_index = calloc(n, sizeof(struct storage*));
+        if(storage_index == NULL) {
+            storage_index = old;
+            return -1;
+        }
+        storage_index_size = n;
+        for(i = 0; i < oldsize; i++) {
+            if(old[i])
+                storage_index_put(old[i]);
+        }
+        free(old);
+    }
+    storage_index_put(st);
+    return 1;
+}
+
+/* The dense array holds the numstorage entries in no particular order,
+   which lets us draw random samples; removal moves the last entry into
+   the hole. */
+static int
+storage_array_add(struct storage *st)
+{
+    if(numstorage >= storage_array_size) {
+        int n = storage_array_size == 0 ? 32 : 2 * storage_array_size;
+        struct storage **new_array =
+            realloc(storage_array, n * sizeof(struct storage*));
+        if(new_array == NULL)
+            return -1;
+        storage_array = new_array;
+        storage_array_size = n;
+    }
+    st->pos = numstorage;
+    storage_array[numstorage] = st;
+    return 1;
+}
+
+static void
+storage_array_remove(struct storage *st)
+{
+    struct storage *last = storage_array[numstorage - 1];
+    storage_array[st->pos] = last;
+    last->pos = st->pos;
+}
+
+/* Remove an entry, moving back the entries that follow it in its probe
+   sequence so that lookups never need tombstones. */
+static void
+storage_index_remove(struct storage *st)
+{
+    unsigned int i, j, k, mask = storage_index_size - 1;
+
+    i = hash_bytes(st->id, 20) & mask;
+    while(storage_index[i] != st) {
+        if(storage_index[i] == NULL)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    j = i;
+    while(1) {
+        storage_index[i] = NULL;
+        do {
+            j = (j + 1) & mask;
+            if(storage_index[j] == NULL)
+                return;
+            k = hash_bytes(storage_index[j]->id, 20) & mask;
+            /* Leave the entry alone if its home slot lies cyclically
+               in (i, j]. */
+        } while(i <= j ? (i < k && k <= j) : (i < k || k <= j));
+        storage_index[i] = storage_index[j];
+        i = j;
+    }
+}
+
+static void
+free_storage(struct storage *st)
+{
+    peerset_clear(&st->peers);
+    peerset_clear(&st->peers6);
+    free(st->times);
+    free(st->times6);
+    free(st->values.data);
+    free(st->values6.data);
+    free(st->bloom);
+    free(st);
+}
+
+/* The number of bytes allocated for a storage entry. */
+static size_t
+storage_size(struct storage *st)
+{
+    return sizeof(struct storage) +
+        st->peers.maxpeers * (6 + sizeof(unsigned short)) +
+        st->peers.indexsize * sizeof(unsigned short) +
+        st->peers6.maxpeers * (18 + sizeof(unsigned short)) +
+        st->peers6.indexsize * sizeof(unsigned short) +
+        st->values.max + st->values6.max +
+        (st->bloom ? 2 * BLOOM_SIZE : 0);
+}
+
+/* Recompute the size of an entry after its peers have grown. */
+static void
+storage_resize(struct storage *st)
+{
+    size_t size = storage_size(st);
+    storage_bytes = storage_bytes - st->size + size;
+    st->size = size;
+}
+
+static void
+storage_link(struct storage *st)
+{
+    st->prev = NULL;
+    st->next = storage;
+    if(storage)
+        storage->prev = st;
+    else
+        storage_tail = st;
+    storage = st;
+}
+
+static void
+storage_unlink(struct storage *st)
+{
+    /* The expiry sweep walks from the tail towards the head. */
+    if(expire_storage_cursor == st)
+        expire_storage_cursor = st->prev;
+    if(st->prev)
+        st->prev->next = st->next;
+    else
+        storage = st->next;
+    if(st->next)
+        st->next->prev = st->prev;
+    else
+        storage_tail = st->prev;
+}
+
+/* Move an entry that has just been queried to the head of the list. */
+static void
+storage_touch(struct storage *st)
+{
+    if(st != storage) {
+        storage_unlink(st);
+        storage_link(st);
+    }
+}
+
+static void
+storage_free_entry(struct storage *st)
+{
+    storage_index_remove(st);
+    storage_array_remove(st);
+    storage_unlink(st);
+    storage_bytes -= st->size;
+    free_storage(st);
+    numstorage--;
+    if(numstorage < 0) {
+        debugf("Eek... numstorage became negative.\n");
+        numstorage = 0;
+    }
+}
+
+static int
+storage_over_budget(void)
+{
+    return storage_bytes +
+        (storage_index_size + storage_array_size) * sizeof(struct storage*) >
+        (size_t)storage_budget;
+}
+
+/* Evict the least recently queried entries, other than keep, until we
+   are within our limits and there is room for extra more hashes. */
+static void
+storage_evict(struct storage *keep, int extra)
+{
+    while(storage_tail &&
+          (numstorage + extra > storage_max_hashes || storage_over_budget())) {
+        struct storage *st = storage_tail;
+        if(st == keep) {
+            st = st->prev;
+            if(st == NULL)
+                break;
+        }
+        debugf("Evicting storage entry with %d+%d peers.\n",
+               st->peers.numpeers, st->peers6.numpeers);
+        storage_free_entry(st);
+    }
+}
+
+/* Copy up to max stored hashes, drawn at random, into buf, and return
+   how many were copied.  This shuffles the first entries of the dense
+   array, which costs O(max) whatever the size of the storage. */
+static int
+storage_sample(unsigned char *buf, int max)
+{
+    int i, j;
+
+    for(i = 0; i < max && i < numstorage; i++) {
+        struct storage *st;
+        j = i + dht_random() % (numstorage - i);
+        st = storage_array[j];
+        storage_array[j] = storage_array[i];
+        storage_array[j]->pos = j;
+        storage_array[i] = st;
+        st->pos = i;
+        memcpy(buf + i * 20, st->id, 20);
+    }
+    return i;
+}
+
+static unsigned short
+peer_time(void)
+{
+    return (now.tv_sec / PEER_TIME_RES) & 0x7FFF;
+}
+
+static int
+peer_age(unsigned short t)
+{
+    return ((peer_time() - t) & 0x7FFF) * PEER_TIME_RES;
+}
+
+/* Note that the peers of one family of an entry have changed, so that
+   whatever was derived from them needs to be rebuilt. */
+static void
+storage_changed(struct storage *st, int len)
+{
+    if(len == 6)
+        st->values.len = -1;
+    else
+        st->values6.len = -1;
+    st->bloom_valid = 0;
+}
+
+static int
+storage_store(const unsigned char *id,
+              const struct sockaddr *sa, unsigned short port, int seed)
+{
+    int k, len, rc;
+    struct storage *st;
+    struct peerset *ps;
+    unsigned short **times;
+    unsigned char peer[18];
+
+    port = htons(port);
+    if(sa->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*)sa;
+        memcpy(peer, &sin->sin_addr, 4);
+        memcpy(peer + 4, &port, 2);
+        len = 6;
+    } else if(sa->sa_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
+        memcpy(peer, &sin6->sin6_addr, 16);
+        memcpy(peer + 16, &port, 2);
+        len = 18;
+    } else {
+        return -1;
+    }
+
+    st = find_storage(id);
+
+    if(st == NULL) {
+        storage_evict(NULL, 1);
+        if(numstorage >= storage_max_hashes || storage_over_budget())
+            return -1;
+        st = calloc(1, sizeof(struct storage));
+        if(st == NULL) return -1;
+        memcpy(st->id, id, 20);
+        if(storage_index_add(st) < 0) {
+            free(st);
+            return -1;
+        }
+        if(storage_array_add(st) < 0) {
+            storage_index_remove(st);
+            free(st);
+            return -1;
+        }
+        /* A new hash counts as just queried, lest it be evicted by the
+           very next announce. */
+        storage_link(st);
+        st->size = sizeof(struct storage);
+        storage_bytes += st->size;
+        numstorage++;
+    }
+
+    ps = len == 6 ? &st->peers : &st->peers6;
+    times = len == 6 ? &st->times : &st->times6;
+
+    k = peerset_find(ps, peer, len);
+    if(k >= 0) {
+        /* Already there, only need to refresh */
+        if(((*times)[k] & PEER_SEED) != (seed ? PEER_SEED : 0))
+            st->bloom_valid = 0;
+        (*times)[k] = peer_time() | (seed ? PEER_SEED : 0);
+        return 0;
+    }
+
+    if(ps->numpeers >= storage_max_peers)
+        return 0;
+
+    /* Grow the peers and their times together, so that there are always
+       at least as many times as room for peers. */
+    if(ps->numpeers >= ps->maxpeers) {
+        unsigned short *new_times;
+        unsigned char *new_peers;
+        int n = ps->maxpeers == 0 ? 2 : 2 * ps->maxpeers;
+        n = MIN(n, DHT_MAX_PEERS);
+        new_times = realloc(*times, n * sizeof(unsigned short));
+        if(new_times == NULL)
+            return -1;
+        *times = new_times;
+        new_peers = realloc(ps->peers, n * len);
+        if(new_peers == NULL)
+            return -1;
+        ps->peers = new_peers;
+        ps->maxpeers = n;
+        storage_resize(st);
+    }
 
-    search_step(sr, callback, closure);
-    search_time = now.tv_sec;
+    rc = peerset_add(ps, peer, len, DHT_MAX_PEERS);
+    storage_resize(st);
+    if(rc < 0)
+        return -1;
+    storage_changed(st, len);
+    (*times)[ps->numpeers - 1] = peer_time() | (seed ? PEER_SEED : 0);
+
+    /* If this entry outgrew the budget, make room at the expense of the
+       others.  An entry on its own may exceed a tiny budget. */
+    storage_evict(st, 0);
     return 1;
 }
 
-/* A struct storage stores all the stored peer addresses for a given info
-   hash. */
-
-static struct storage *
-find_storage(const unsigned char *id)
+/* Return the encoded peers of an entry for a given family, rebuilding
+   them if they have changed since they were last used. */
+static struct values *
+storage_values(struct storage *st, int af)
 {
-    struct storage *st = storage;
+    struct peerset *ps = af == AF_INET ? &st->peers : &st->peers6;
+    struct values *v = af == AF_INET ? &st->values : &st->values6;
+    int len = af == AF_INET ? 6 : 18;
+    int rec = af == AF_INET ? 8 : 21;
+    unsigned char *p;
+    int k;
+
+    if(v->len >= 0)
+        return v;
+
+    if(ps->numpeers * rec > v->max) {
+        unsigned char *new_data = realloc(v->data, ps->maxpeers * rec);
+        if(new_data == NULL)
+            return NULL;
+        v->data = new_data;
+        v->max = ps->maxpeers * rec;
+        storage_resize(st);
+    }
 
-    while(st) {
-        if(id_cmp(id, st->id) == 0)
-            break;
-        st = st->next;
+    p = v->data;
+    for(k = 0; k < ps->numpeers; k++) {
+        if(len == 6) {
+            memcpy(p, "6:", 2);
+            p += 2;
+        } else {
+            memcpy(p, "18:", 3);
+            p += 3;
+        }
+        memcpy(p, ps->peers + k * len, len);
+        p += len;
     }
-    return st;
+    v->len = p - v->data;
+    return v;
 }
 
-static int
-storage_store(const unsigned char *id,
-              const struct sockaddr *sa, unsigned short port)
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* The SHA-1 of a message short enough to fit in a single block, which is
+   all that the bloom filters of BEP 33 need. */
+static void
+sha1_short(unsigned char *hash_return, const unsigned char *data, int len)
 {
-    int i, len;
-    struct storage *st;
-    unsigned char *ip;
+    unsigned int h[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+    };
+    unsigned int w[80], a, b, c, d, e, f, k, t;
+    unsigned char block[64];
+    int i;
 
-    if(sa->sa_family == AF_INET) {
-        struct sockaddr_in *sin = (struct sockaddr_in*)sa;
-        ip = (unsigned char*)&sin->sin_addr;
-        len = 4;
-    } else if(sa->sa_family == AF_INET6) {
-        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
-        ip = (unsigned char*)&sin6->sin6_addr;
-        len = 16;
-    } else {
-        return -1;
+    memset(block, 0, 64);
+    memcpy(block, data, len);
+    block[len] = 0x80;
+    block[62] = (len * 8) >> 8;
+    block[63] = (len * 8) & 0xFF;
+
+    for(i = 0; i < 16; i++)
+        w[i] = ((unsigned int)block[4 * i] << 24) |
+            (block[4 * i + 1] << 16) | (block[4 * i + 2] << 8) |
+            block[4 * i + 3];
+    for(i = 16; i < 80; i++) {
+        t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+        w[i] = ROL32(t, 1) & 0xFFFFFFFF;
     }
 
-    st = find_storage(id);
-
-    if(st == NULL) {
-        if(numstorage >= DHT_MAX_HASHES)
-            return -1;
-        st = calloc(1, sizeof(struct storage));
-        if(st == NULL) return -1;
-        memcpy(st->id, id, 20);
-        st->next = storage;
-        storage = st;
-        numstorage++;
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+    for(i = 0; i < 80; i++) {
+        if(i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if(i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if(i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        t = (ROL32(a, 5) + f + e + k + w[i]) & 0xFFFFFFFF;
+        e = d;
+        d = c;
+        c = ROL32(b, 30) & 0xFFFFFFFF;
+        b = a;
+        a = t;
     }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
 
-    for(i = 0; i < st->numpeers; i++) {
-        if(st->peers[i].port == port && st->peers[i].len == len &&
-           memcmp(st->peers[i].ip, ip, len) == 0)
-            break;
+    for(i = 0; i < 20; i++)
+        hash_return[i] = (h[i / 4] >> (24 - 8 * (i % 4))) & 0xFF;
+}
+
+/* Insert an IPv4 or IPv6 address into a BEP 33 bloom filter. */
+static void
+bloom_insert(unsigned char *bloom, const unsigned char *ip, int len)
+{
+    unsigned char hash[20];
+    int i1, i2;
+
+    sha1_short(hash, ip, len);
+    i1 = (hash[0] | (hash[1] << 8)) % (BLOOM_SIZE * 8);
+    i2 = (hash[2] | (hash[3] << 8)) % (BLOOM_SIZE * 8);
+    bloom[i1 / 8] |= 1 << (i1 % 8);
+    bloom[i2 / 8] |= 1 << (i2 % 8);
+}
+
+/* Return the bloom filters of the seeds and of the other peers of an
+   entry, rebuilding them if its peers have changed. */
+static unsigned char *
+storage_bloom(struct storage *st)
+{
+    int k;
+
+    if(st->bloom_valid)
+        return st->bloom;
+
+    if(st->bloom == NULL) {
+        st->bloom = malloc(2 * BLOOM_SIZE);
+        if(st->bloom == NULL)
+            return NULL;
+        storage_resize(st);
     }
 
-    if(i < st->numpeers) {
-        /* Already there, only need to refresh */
-        st->peers[i].time = now.tv_sec;
-        return 0;
-    } else {
-        struct peer *p;
-        if(i >= st->maxpeers) {
-            /* Need to expand the array. */
-            struct peer *new_peers;
-            int n;
-            if(st->maxpeers >= DHT_MAX_PEERS)
-                return 0;
-            n = st->maxpeers == 0 ? 2 : 2 * st->maxpeers;
-            n = MIN(n, DHT_MAX_PEERS);
-            new_peers = realloc(st->peers, n * sizeof(struct peer));
-            if(new_peers == NULL)
-                return -1;
-            st->peers = new_peers;
-            st->maxpeers = n;
-        }
-        p = &st->peers[st->numpeers++];
-        p->time = now.tv_sec;
-        p->len = len;
-        memcpy(p->ip, ip, len);
-        p->port = port;
-        return 1;
+    memset(st->bloom, 0, 2 * BLOOM_SIZE);
+    for(k = 0; k < st->peers.numpeers; k++)
+        bloom_insert(st->bloom + ((st->times[k] & PEER_SEED) ?
+                                  0 : BLOOM_SIZE),
+                     st->peers.peers + k * 6, 4);
+    for(k = 0; k < st->peers6.numpeers; k++)
+        bloom_insert(st->bloom + ((st->times6[k] & PEER_SEED) ?
+                                  0 : BLOOM_SIZE),
+                     st->peers6.peers + k * 18, 16);
+    st->bloom_valid = 1;
+    return st->bloom;
+}
+
+/* Drop the stale peers of a set, and return how many were dropped. */
+static int
+expire_storage_peers(struct peerset *ps, unsigned short *times, int len)
+{
+    int i = 0, n = 0;
+    while(i < ps->numpeers) {
+        if(peer_age(times[i]) > 32 * 60) {
+            times[i] = times[ps->numpeers - 1];
+            peerset_remove(ps, i, len);
+            n++;
+        } else {
+            i++;
+        }
     }
+    return n;
 }
 
+/* Expire the stale peers of a storage entry, and free it once it is
+   empty.  Returns the number of peers examined. */
 static int
-expire_storage(void)
+expire_storage(struct storage *st)
 {
-    struct storage *st = storage, *previous = NULL;
-    while(st) {
-        int i = 0;
-        while(i < st->numpeers) {
-            if(st->peers[i].time < now.tv_sec - 32 * 60) {
-                if(i != st->numpeers - 1)
-                    st->peers[i] = st->peers[st->numpeers - 1];
-                st->numpeers--;
+    int work = 1 + st->peers.numpeers + st->peers6.numpeers;
+
+    if(expire_storage_peers(&st->peers, st->times, 6) > 0)
+        storage_changed(st, 6);
+    if(expire_storage_peers(&st->peers6, st->times6, 18) > 0)
+        storage_changed(st, 18);
+
+    if(st->peers.numpeers == 0 && st->peers6.numpeers == 0)
+        storage_free_entry(st);
+    return work;
+}
+
+/* Expiry is spread over successive calls to dht_periodic.  A sweep walks
+   the buckets, the storage and the searches in turn, and each call
+   examines at most DHT_EXPIRE_SLICE nodes or peers before resuming
+   where it left off, so that no single call grows with the size of the
+   tables.  Buckets and searches are only ever unlinked here, which keeps
+   their cursors valid between calls; storage entries fix up the cursor
+   when they are unlinked, and the sweep walks them from the tail so
+   that entries moved to the head are not skipped. */
+static void
+expire_stuff(void)
+{
+    int work = 0;
+
+    if(expire_phase == EXPIRE_IDLE) {
+        expire_phase = EXPIRE_BUCKETS;
+        expire_bucket_cursor = buckets;
+    }
+
+    while(work < DHT_EXPIRE_SLICE) {
+        switch(expire_phase) {
+        case EXPIRE_BUCKETS:
+        case EXPIRE_BUCKETS6:
+            if(expire_bucket_cursor) {
+                work += expire_bucket(expire_bucket_cursor);
+                expire_bucket_cursor = expire_bucket_cursor->next;
+            } else if(expire_phase == EXPIRE_BUCKETS) {
+                expire_phase = EXPIRE_BUCKETS6;
+                expire_bucket_cursor = buckets6;
             } else {
-                i++;
+                expire_phase = EXPIRE_STORAGE;
+                expire_storage_cursor = storage_tail;
             }
-        }
-
-        if(st->numpeers == 0) {
-            free(st->peers);
-            if(previous)
-                previous->next = st->next;
-            else
-                storage = st->next;
-            free(st);
-            if(previous)
-                st = previous->next;
-            else
-                st = storage;
-            numstorage--;
-            if(numstorage < 0) {
-                debugf("Eek... numstorage became negative.\n");
-                numstorage = 0;
+            break;
+        case EXPIRE_STORAGE:
+            if(expire_storage_cursor) {
+                struct storage *st = expire_storage_cursor;
+                expire_storage_cursor = st->prev;
+                work += expire_storage(st);
+            } else {
+                expire_phase = EXPIRE_SEARCHES;
+                expire_search_cursor = &searches;
             }
-        } else {
-            previous = st;
-            st = st->next;
+            break;
+        case EXPIRE_SEARCHES:
+            if(*expire_search_cursor) {
+                struct search *sr = *expire_search_cursor;
+                expire_search(expire_search_cursor);
+                if(*expire_search_cursor == sr)
+                    expire_search_cursor = &sr->next;
+                work++;
+            } else {
+                expire_phase = EXPIRE_IDLE;
+                expire_stuff_time = now.tv_sec + 120 + dht_random() % 240;
+                return;
+            }
+            break;
+        default:
+            abort();
         }
     }
-    return 1;
 }
 
 static int
@@ -1420,7 +3140,7 @@ rotate_secrets(void)
 {
     int rc;
 
-    rotate_secrets_time = now.tv_sec + 900 + random() % 1800;
+    rotate_secrets_time = now.tv_sec + 900 + dht_random() % 1800;
 
     memcpy(oldsecret, secret, sizeof(secret));
     rc = dht_random_bytes(secret, sizeof(secret));
@@ -1431,34 +3151,90 @@ rotate_secrets(void)
     return 1;
 }
 
-#ifndef TOKEN_SIZE
+#define ROL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+#define SIPROUND                                                        \
+    do {                                                                \
+        v0 += v1; v1 = ROL64(v1, 13); v1 ^= v0; v0 = ROL64(v0, 32);     \
+        v2 += v3; v3 = ROL64(v3, 16); v3 ^= v2;                         \
+        v0 += v3; v3 = ROL64(v3, 21); v3 ^= v0;                         \
+        v2 += v1; v1 = ROL64(v1, 17); v1 ^= v2; v2 = ROL64(v2, 32);     \
+    } while(0)
+
+static uint64_t
+load64_le(const unsigned char *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+        (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+        (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+        (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+/* SipHash-2-4 of Aumasson and Bernstein, a keyed hash that is much
+   cheaper than a cryptographic digest on inputs as short as ours. */
+static uint64_t
+siphash(const unsigned char *key, const unsigned char *data, int len)
+{
+    uint64_t k0 = load64_le(key), k1 = load64_le(key + 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    uint64_t m;
+    int i;
+
+    for(i = 0; i + 8 <= len; i += 8) {
+        m = load64_le(data + i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    m = (uint64_t)len << 56;
+    for(; i < len; i++)
+        m |= (uint64_t)data[i] << (8 * (i % 8));
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+
 #define TOKEN_SIZE 8
-#endif
 
 static void
 make_token(const struct sockaddr *sa, int old, unsigned char *token_return)
 {
-    void *ip;
-    int iplen;
-    unsigned short port;
+    unsigned char buf[18];
+    int len, i;
+    uint64_t h;
 
     if(sa->sa_family == AF_INET) {
         struct sockaddr_in *sin = (struct sockaddr_in*)sa;
-        ip = &sin->sin_addr;
-        iplen = 4;
-        port = htons(sin->sin_port);
+        memcpy(buf, &sin->sin_addr, 4);
+        memcpy(buf + 4, &sin->sin_port, 2);
+        len = 6;
     } else if(sa->sa_family == AF_INET6) {
         struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
-        ip = &sin6->sin6_addr;
-        iplen = 16;
-        port = htons(sin6->sin6_port);
+        memcpy(buf, &sin6->sin6_addr, 16);
+        memcpy(buf + 16, &sin6->sin6_port, 2);
+        len = 18;
     } else {
         abort();
     }
 
-    dht_hash(token_return, TOKEN_SIZE,
-             old ? oldsecret : secret, sizeof(secret),
-             ip, iplen, (unsigned char*)&port, 2);
+    h = siphash(old ? oldsecret : secret, buf, len);
+    for(i = 0; i < TOKEN_SIZE; i++)
+        token_return[i] = h >> (8 * i);
 }
 static int
 token_match(const unsigned char *token, int token_len,
@@ -1548,6 +3324,8 @@ dump_bucket(FILE *f, struct bucket *b)
                     (long)(now.tv_sec - n->reply_time));
         else
             fprintf(f, "age %ld", (long)(now.tv_sec - n->time));
+        if(n->rtt)
+            fprintf(f, " rtt %d", n->rtt);
         if(n->pinged)
             fprintf(f, " (%d)", n->pinged);
         if(node_good(n))
@@ -1587,15 +3365,18 @@ dht_dump_tables(FILE *f)
     while(sr) {
         fprintf(f, "\nSearch%s id ", sr->af == AF_INET6 ? " (IPv6)" : "");
         print_hex(f, sr->id, 20);
-        fprintf(f, " age %d%s\n", (int)(now.tv_sec - sr->step_time),
-               sr->done ? " (done)" : "");
+        fprintf(f, " age %d alpha %d rtt %d peers %d+%d%s\n",
+                (int)(now.tv_sec - sr->step_time.tv_sec), sr->alpha, sr->rtt,
+                sr->peers.numpeers, sr->peers6.numpeers,
+                sr->done ? " (done)" : "");
         for(i = 0; i < sr->numnodes; i++) {
             struct search_node *n = &sr->nodes[i];
             fprintf(f, "Node %d id ", i);
             print_hex(f, n->id, 20);
             fprintf(f, " bits %d age ", common_bits(sr->id, n->id));
-            if(n->request_time)
-                fprintf(f, "%d, ", (int)(now.tv_sec - n->request_time));
+            if(timerisset(&n->request_time))
+                fprintf(f, "%d, ",
+                        (int)(now.tv_sec - n->request_time.tv_sec));
             fprintf(f, "%d", (int)(now.tv_sec - n->reply_time));
             if(n->pinged)
                 fprintf(f, " (%d)", n->pinged);
@@ -1606,24 +3387,32 @@ dht_dump_tables(FILE *f)
         sr = sr->next;
     }
 
+    if(numpending > 0)
+        fprintf(f, "\n%d pending searches\n", numpending);
+
+    if(numstorage > 0)
+        fprintf(f, "\n%d hashes stored in %lu bytes\n",
+                numstorage, (unsigned long)storage_bytes);
+
     while(st) {
         fprintf(f, "\nStorage ");
         print_hex(f, st->id, 20);
-        fprintf(f, " %d/%d nodes:", st->numpeers, st->maxpeers);
-        for(i = 0; i < st->numpeers; i++) {
+        fprintf(f, " %d+%d nodes:", st->peers.numpeers, st->peers6.numpeers);
+        for(i = 0; i < st->peers.numpeers; i++) {
             char buf[100];
-            if(st->peers[i].len == 4) {
-                inet_ntop(AF_INET, st->peers[i].ip, buf, 100);
-            } else if(st->peers[i].len == 16) {
-                buf[0] = '[';
-                inet_ntop(AF_INET6, st->peers[i].ip, buf + 1, 98);
-                strcat(buf, "]");
-            } else {
-                strcpy(buf, "???");
-            }
-            fprintf(f, " %s:%u (%ld)",
-                    buf, st->peers[i].port,
-                    (long)(now.tv_sec - st->peers[i].time));
+            unsigned char *p = st->peers.peers + i * 6;
+            inet_ntop(AF_INET, p, buf, 100);
+            fprintf(f, " %s:%u (%d%s)",
+                    buf, (p[4] << 8) | p[5], peer_age(st->times[i]),
+                    (st->times[i] & PEER_SEED) ? ", seed" : "");
+        }
+        for(i = 0; i < st->peers6.numpeers; i++) {
+            char buf[100];
+            unsigned char *p = st->peers6.peers + i * 18;
+            inet_ntop(AF_INET6, p, buf, 100);
+            fprintf(f, " [%s]:%u (%d%s)",
+                    buf, (p[16] << 8) | p[17], peer_age(st->times6[i]),
+                    (st->times6[i] & PEER_SEED) ? ", seed" : "");
         }
         st = st->next;
     }
@@ -1646,7 +3435,9 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     numsearches = 0;
 
     storage = NULL;
+    storage_tail = NULL;
     numstorage = 0;
+    storage_bytes = 0;
 
     if(s >= 0) {
         buckets = calloc(sizeof(struct bucket), 1);
@@ -1671,27 +3462,56 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     }
 
     memcpy(myid, id, 20);
+    memcpy(query_head, "d1:ad2:id20:", 12);
+    memcpy(query_head + 12, myid, 20);
+    memcpy(reply_head, "d1:rd2:id20:", 12);
+    memcpy(reply_head + 12, myid, 20);
+    tail_len = 0;
     if(v) {
-        memcpy(my_v, "1:v4:", 5);
-        memcpy(my_v + 5, v, 4);
-        have_v = 1;
-    } else {
-        have_v = 0;
+        memcpy(query_tail, "1:v4:", 5);
+        memcpy(query_tail + 5, v, 4);
+        tail_len = 9;
     }
+    memcpy(reply_tail, query_tail, tail_len);
+    memcpy(error_tail, query_tail, tail_len);
+    memcpy(query_tail + tail_len, "1:y1:qe", 7);
+    memcpy(reply_tail + tail_len, "1:y1:re", 7);
+    memcpy(error_tail + tail_len, "1:y1:ee", 7);
+    tail_len += 7;
+
+    rc = dht_random_bytes(prng_state, sizeof(prng_state));
+    if(rc < 0)
+        goto fail;
+    /* The generator must not be seeded with all zeroes. */
+    prng_state[0] |= 1;
 
     gettimeofday(&now, NULL);
 
     mybucket_grow_time = now.tv_sec;
     mybucket6_grow_time = now.tv_sec;
-    confirm_nodes_time = now.tv_sec + random() % 3;
+    confirm_nodes_time = now.tv_sec + dht_random() % 3;
+
+    search_id = dht_random() & 0xFFFF;
+    timerclear(&search_time);
+    timerclear(&wakeup_time);
 
-    search_id = random() & 0xFFFF;
-    search_time = 0;
+    memset(transactions, 0, sizeof(transactions));
+    transaction_id = dht_random() & 0xFFFF;
+    /* Unlike the generator's output, this must not be guessable. */
+    rc = dht_random_bytes(&hash_seed, sizeof(hash_seed));
+    if(rc < 0)
+        goto fail;
 
     next_blacklisted = 0;
 
     token_bucket_time = now.tv_sec;
-    token_bucket_tokens = MAX_TOKEN_BUCKET_TOKENS;
+    token_bucket_tokens = RATE_BURST * request_rate;
+    memset(prefix_limit.cells, 0, sizeof(prefix_limit.cells));
+    memset(announce_limit.cells, 0, sizeof(announce_limit.cells));
+    load = 0;
+    memset(message_stats, 0, sizeof(message_stats));
+    send_next = 0;
+    memset(send_queues, 0, sizeof(send_queues));
 
     memset(secret, 0, sizeof(secret));
     rc = rotate_secrets();
@@ -1701,8 +3521,8 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     dht_socket = s;
     dht_socket6 = s6;
 
-    expire_buckets(buckets);
-    expire_buckets(buckets6);
+    expire_phase = EXPIRE_IDLE;
+    expire_stuff_time = now.tv_sec + 120 + dht_random() % 240;
 
     return 1;
 
@@ -1723,6 +3543,8 @@ dht_uninit()
     dht_socket = -1;
     dht_socket6 = -1;
 
+    send_queues_clear();
+
     while(buckets) {
         struct bucket *b = buckets;
         buckets = b->next;
@@ -1748,15 +3570,30 @@ dht_uninit()
     while(storage) {
         struct storage *st = storage;
         storage = storage->next;
-        free(st->peers);
-        free(st);
+        free_storage(st);
     }
+    storage_tail = NULL;
+    storage_bytes = 0;
+    free(storage_index);
+    storage_index = NULL;
+    storage_index_size = 0;
+    free(storage_array);
+    storage_array = NULL;
+    storage_array_size = 0;
 
     while(searches) {
         struct search *sr = searches;
         searches = searches->next;
+        peerset_clear(&sr->peers);
+        peerset_clear(&sr->peers6);
+        free(sr->bloom);
         free(sr);
     }
+    expire_phase = EXPIRE_IDLE;
+
+    free(pending);
+    pending = NULL;
+    firstpending = numpending = maxpending = 0;
 
     return 1;
 }
@@ -1767,8 +3604,8 @@ static int
 token_bucket(void)
 {
     if(token_bucket_tokens == 0) {
-        token_bucket_tokens = MIN(MAX_TOKEN_BUCKET_TOKENS,
-                                  100 * (now.tv_sec - token_bucket_time));
+        token_bucket_tokens =
+            request_rate * MIN(RATE_BURST, now.tv_sec - token_bucket_time);
         token_bucket_time = now.tv_sec;
     }
 
@@ -1779,6 +3616,63 @@ token_bucket(void)
     return 1;
 }
 
+static int
+shed_request(int message)
+{
+    if(shed_load <= 0 || load < shed_load)
+        return 0;
+
+    switch(message) {
+    case FIND_NODE:
+    case SAMPLE_INFOHASHES:
+        return 1;
+    case GET_PEERS:
+    case PING:
+        return load >= (shed_load + 100) / 2;
+    default:
+        return 0;
+    }
+}
+
+/* Check that the buckets of the prefix of sa both hold a token, and
+   take it if take is set.  Returns 0 if either of them is empty. */
+static int
+prefix_bucket(struct rate_limit *rl, const struct sockaddr *sa, int take)
+{
+    int64_t t, interval, *c0, *c1;
+    unsigned int h;
+
+    if(rl->rate <= 0)
+        return 1;
+
+    if(sa->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*)sa;
+        h = hash_bytes((const unsigned char*)&sin->sin_addr, 3);
+    } else if(sa->sa_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
+        h = hash_bytes((const unsigned char*)&sin6->sin6_addr, 8);
+    } else {
+        return 0;
+    }
+
+    c0 = &rl->cells[0][h % RATE_CELLS];
+    c1 = &rl->cells[1][(h / RATE_CELLS) % RATE_CELLS];
+
+    /* A request is admitted if it leaves the bucket no further than
+       RATE_BURST seconds from being full again. */
+    t = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    interval = 1000000 / rl->rate;
+    if(*c0 - t > RATE_BURST * 1000000 - interval ||
+       *c1 - t > RATE_BURST * 1000000 - interval)
+        return 0;
+
+    if(take) {
+        *c0 = MAX(*c0, t) + interval;
+        *c1 = MAX(*c1, t) + interval;
+    }
+    return 1;
+}
+
 static int
 neighbourhood_maintenance(int af)
 {
@@ -1791,11 +3685,11 @@ neighbourhood_maintenance(int af)
         return 0;
 
     memcpy(id, myid, 20);
-    id[19] = random() & 0xFF;
+    id[19] = dht_random() & 0xFF;
     q = b;
-    if(q->next && (q->count == 0 || (random() & 7) == 0))
+    if(q->next && (q->count == 0 || (dht_random() & 7) == 0))
         q = b->next;
-    if(q->count == 0 || (random() & 7) == 0) {
+    if(q->count == 0 || (dht_random() & 7) == 0) {
         struct bucket *r;
         r = previous_bucket(b);
         if(r && r->count > 0)
@@ -1811,11 +3705,13 @@ neighbourhood_maintenance(int af)
             unsigned char tid[4];
             debugf("Sending find_node for%s neighborhood maintenance.\n",
                    af == AF_INET6 ? " IPv6" : "");
-            make_tid(tid, "fn", 0);
-            send_find_node((struct sockaddr*)&n->ss, n->sslen,
-                           tid, 4, id, want,
-                           n->reply_time >= now.tv_sec - 15);
-            pinged(n, q);
+            if(new_transaction(tid, "fn", n->id,
+                               (struct sockaddr*)&n->ss, n->sslen, 0) < 0)
+                return 0;
+            if(send_find_node((struct sockaddr*)&n->ss, n->sslen,
+                              tid, 4, id, want,
+                              n->reply_time >= now.tv_sec - 15) >= 0)
+                pinged(n, q);
         }
         return 1;
     }
@@ -1847,9 +3743,9 @@ bucket_maintenance(int af)
             /* If the bucket is empty, we try to fill it from a neighbour.
                We also sometimes do it gratuitiously to recover from
                buckets full of broken nodes. */
-            if(q->next && (q->count == 0 || (random() & 7) == 0))
+            if(q->next && (q->count == 0 || (dht_random() & 7) == 0))
                 q = b->next;
-            if(q->count == 0 || (random() & 7) == 0) {
+            if(q->count == 0 || (dht_random() & 7) == 0) {
                 struct bucket *r;
                 r = previous_bucket(b);
                 if(r && r->count > 0)
@@ -1870,7 +3766,7 @@ bucket_maintenance(int af)
                             /* The corresponding bucket in the other family
                                is emptyish -- querying both is useful. */
                             want = WANT4 | WANT6;
-                        else if(random() % 37 == 0)
+                        else if(dht_random() % 37 == 0)
                             /* Most of the time, this just adds overhead.
                                However, it might help stitch back one of
                                the DHTs after a network collapse, so query
@@ -1880,11 +3776,14 @@ bucket_maintenance(int af)
 
                     debugf("Sending find_node for%s bucket maintenance.\n",
                            af == AF_INET6 ? " IPv6" : "");
-                    make_tid(tid, "fn", 0);
-                    send_find_node((struct sockaddr*)&n->ss, n->sslen,
-                                   tid, 4, id, want,
-                                   n->reply_time >= now.tv_sec - 15);
-                    pinged(n, q);
+                    if(new_transaction(tid, "fn", n->id,
+                                       (struct sockaddr*)&n->ss,
+                                       n->sslen, 0) < 0)
+                        return 0;
+                    if(send_find_node((struct sockaddr*)&n->ss, n->sslen,
+                                      tid, 4, id, want,
+                                      n->reply_time >= now.tv_sec - 15) >= 0)
+                        pinged(n, q);
                     /* In order to avoid sending queries back-to-back,
                        give up for now and reschedule us soon. */
                     return 1;
@@ -1903,18 +3802,15 @@ dht_periodic(const void *buf, size_t buflen,
              dht_callback *callback, void *closure)
 {
     gettimeofday(&now, NULL);
+    numinflight = -1;
 
     if(buflen > 0) {
         int message;
-        unsigned char tid[16], id[20], info_hash[20], target[20];
-        unsigned char nodes[256], nodes6[1024], token[128];
-        int tid_len = 16, token_len = 128;
-        int nodes_len = 256, nodes6_len = 1024;
-        unsigned short port;
-        unsigned char values[2048], values6[2048];
-        int values_len = 2048, values6_len = 2048;
-        int want;
-        unsigned short ttid;
+        struct message m;
+        struct transaction *t;
+        struct node *node;
+        unsigned short sid;
+        int rtt;
 
         if(is_martian(from))
             goto dontread;
@@ -1924,74 +3820,107 @@ dht_periodic(const void *buf, size_t buflen,
             goto dontread;
         }
 
-        if(((char*)buf)[buflen] != '\0') {
-            debugf("Unterminated message.\n");
-            errno = EINVAL;
-            return -1;
-        }
+        message = parse_message(buf, buflen, &m);
 
-        message = parse_message(buf, buflen, tid, &tid_len, id, info_hash,
-                                target, &port, token, &token_len,
-                                nodes, &nodes_len, nodes6, &nodes6_len,
-                                values, &values_len, values6, &values6_len,
-                                &want);
-
-        if(message < 0 || message == ERROR || id_cmp(id, zeroes) == 0) {
+        if(message < 0 || message == ERROR || id_cmp(m.id, zeroes) == 0) {
             debugf("Unparseable message: ");
             debug_printable(buf, buflen);
             debugf("\n");
             goto dontread;
         }
 
-        if(id_cmp(id, myid) == 0) {
+        if(id_cmp(m.id, myid) == 0) {
             debugf("Received message from self.\n");
             goto dontread;
         }
 
+        message_stats[message].received++;
+
         if(message > REPLY) {
-            /* Rate limit requests. */
+            if(shed_request(message)) {
+                debugf("Shedding request due to overload.\n");
+                message_stats[message].shed++;
+                goto dontread;
+            }
+            /* Rate limit requests, per prefix first so that abusers do
+               not eat into the global budget.  Tokens are only taken
+               once every limit has admitted the request. */
+            if(!prefix_bucket(&prefix_limit, from, 0) ||
+               (message == ANNOUNCE_PEER &&
+                !prefix_bucket(&announce_limit, from, 0))) {
+                debugf("Dropping request due to per-prefix rate limiting.\n");
+                message_stats[message].limited++;
+                goto dontread;
+            }
             if(!token_bucket()) {
                 debugf("Dropping request due to rate limiting.\n");
+                message_stats[message].limited++;
                 goto dontread;
             }
+            prefix_bucket(&prefix_limit, from, 1);
+            if(message == ANNOUNCE_PEER)
+                prefix_bucket(&announce_limit, from, 1);
         }
 
         switch(message) {
         case REPLY:
-            if(tid_len != 4) {
+            if(m.tid_len != 4) {
                 debugf("Broken node truncates transaction ids: ");
                 debug_printable(buf, buflen);
                 debugf("\n");
                 /* This is really annoying, as it means that we will
                    time-out all our searches that go through this node.
                    Kill it. */
-                blacklist_node(id, from, fromlen);
+                blacklist_node(m.id, from, fromlen);
+                goto dontread;
+            }
+            t = find_transaction(m.tid, m.tid_len, m.id, from);
+            if(t == NULL) {
+                debugf("Unsolicited reply: ");
+                debug_printable(buf, buflen);
+                debugf("\n");
                 goto dontread;
             }
-            if(tid_match(tid, "pn", NULL)) {
+            /* Close the transaction, so that duplicate replies are
+               ignored. */
+            t->sslen = 0;
+            sid = t->sid;
+            rtt = msecs_since(&t->time);
+            node = find_node(m.id, from->sa_family);
+            if(node)
+                update_rtt(&node->rtt, &node->rttvar, rtt);
+            if(tid_match(m.tid, "pn", NULL)) {
                 debugf("Pong!\n");
-                new_node(id, from, fromlen, 2);
-            } else if(tid_match(tid, "fn", NULL) ||
-                      tid_match(tid, "gp", NULL)) {
+                node = new_node(m.id, from, fromlen, 2);
+                if(node && node->rtt == 0)
+                    update_rtt(&node->rtt, &node->rttvar, rtt);
+            } else if(tid_match(m.tid, "fn", NULL) ||
+                      tid_match(m.tid, "gp", NULL)) {
                 int gp = 0;
                 struct search *sr = NULL;
-                if(tid_match(tid, "gp", &ttid)) {
+                if(tid_match(m.tid, "gp", NULL)) {
                     gp = 1;
-                    sr = find_search(ttid, from->sa_family);
+                    sr = find_search(sid, from->sa_family);
                 }
-                debugf("Nodes found (%d+%d)%s!\n", nodes_len/26, nodes6_len/38,
+                debugf("Nodes found (%d+%d)%s!\n",
+                       m.nodes_len / 26, m.nodes6_len / 38,
                        gp ? " for get_peers" : "");
-                if(nodes_len % 26 != 0 || nodes6_len % 38 != 0) {
+                if(m.nodes_len % 26 != 0 || m.nodes6_len % 38 != 0) {
                     debugf("Unexpected length for node info!\n");
-                    blacklist_node(id, from, fromlen);
+                    blacklist_node(m.id, from, fromlen);
                 } else if(gp && sr == NULL) {
                     debugf("Unknown search!\n");
-                    new_node(id, from, fromlen, 1);
+                    new_node(m.id, from, fromlen, 1);
                 } else {
-                    int i;
-                    new_node(id, from, fromlen, 2);
-                    for(i = 0; i < nodes_len / 26; i++) {
-                        unsigned char *ni = nodes + i * 26;
+                    struct search *share[SEARCH_SHARE];
+                    int i, numshare = 0;
+                    node = new_node(m.id, from, fromlen, 2);
+                    if(node && node->rtt == 0)
+                        update_rtt(&node->rtt, &node->rttvar, rtt);
+                    if(sr)
+                        numshare = share_searches(sr, share);
+                    for(i = 0; i < m.nodes_len / 26; i++) {
+                        const unsigned char *ni = m.nodes + i * 26;
                         struct sockaddr_in sin;
                         if(id_cmp(ni, myid) == 0)
                             continue;
@@ -2004,11 +3933,14 @@ dht_periodic(const void *buf, size_t buflen,
                             insert_search_node(ni,
                                                (struct sockaddr*)&sin,
                                                sizeof(sin),
-                                               sr, 0, NULL, 0);
+                                               sr, 0, NULL, 0, 0);
+                            share_search_node(share, numshare, ni,
+                                              (struct sockaddr*)&sin,
+                                              sizeof(sin));
                         }
                     }
-                    for(i = 0; i < nodes6_len / 38; i++) {
-                        unsigned char *ni = nodes6 + i * 38;
+                    for(i = 0; i < m.nodes6_len / 38; i++) {
+                        const unsigned char *ni = m.nodes6 + i * 38;
                         struct sockaddr_in6 sin6;
                         if(id_cmp(ni, myid) == 0)
                             continue;
@@ -2021,52 +3953,97 @@ dht_periodic(const void *buf, size_t buflen,
                             insert_search_node(ni,
                                                (struct sockaddr*)&sin6,
                                                sizeof(sin6),
-                                               sr, 0, NULL, 0);
+                                               sr, 0, NULL, 0, 0);
+                            share_search_node(share, numshare, ni,
+                                              (struct sockaddr*)&sin6,
+                                              sizeof(sin6));
                         }
                     }
-                    if(sr)
-                        /* Since we received a reply, the number of
-                           requests in flight has decreased.  Let's push
-                           another request. */
+                    /* Since we received a reply, the number of requests
+                       in flight has decreased.  Let's push another
+                       request, unless searches are waiting for the
+                       budget, in which case they get it in order of
+                       priority. */
+                    if(sr && search_starved)
+                        search_time = now;
+                    else if(sr && !search_reply_driven)
                         search_send_get_peers(sr, NULL);
                 }
                 if(sr) {
-                    insert_search_node(id, from, fromlen, sr,
-                                       1, token, token_len);
-                    if(values_len > 0 || values6_len > 0) {
-                        debugf("Got values (%d+%d)!\n",
-                               values_len / 6, values6_len / 18);
-                        if(callback) {
-                            if(values_len > 0)
-                                (*callback)(closure, DHT_EVENT_VALUES, sr->id,
-                                            (void*)values, values_len);
-
-                            if(values6_len > 0)
-                                (*callback)(closure, DHT_EVENT_VALUES6, sr->id,
-                                            (void*)values6, values6_len);
+                    struct timeval tv;
+                    update_rtt(&sr->rtt, &sr->rttvar, rtt);
+                    /* The next step is due earlier if the timeout has
+                       just shrunk. */
+                    add_msecs(&tv, &sr->step_time, search_rto(sr));
+                    schedule_search(&tv);
+                    if(sr->alpha > search_alpha)
+                        sr->alpha--;
+                    insert_search_node(m.id, from, fromlen, sr,
+                                       1, m.token, m.token_len,
+                                       node ? node_rto(node) : 0);
+                    if(sr->kind == SEARCH_SCRAPE) {
+                        /* Missing filters are empty, and need no
+                           merging. */
+                        int i;
+                        for(i = 0; m.bfsd && i < BLOOM_SIZE; i++)
+                            sr->bloom[i] |= m.bfsd[i];
+                        for(i = 0; m.bfpe && i < BLOOM_SIZE; i++)
+                            sr->bloom[BLOOM_SIZE + i] |= m.bfpe[i];
+                    } else if(sr->kind == SEARCH_SAMPLE) {
+                        debugf("Got samples (%d)!\n", m.samples_len / 20);
+                        if(callback && m.samples_len > 0 && !sr->quiet)
+                            (*callback)(closure, DHT_EVENT_SAMPLES, sr->id,
+                                        m.samples, m.samples_len);
+                    } else if(m.numvalues > 0 || m.numvalues6 > 0) {
+                        int fresh;
+                        fresh = add_search_values(sr, m.values, m.values_len);
+                        debugf("Got values (%d+%d, %d new)!\n",
+                               m.numvalues, m.numvalues6, fresh);
+                        /* Peers are passed on in batches, at most every
+                           search_batch milliseconds. */
+                        if(fresh > 0) {
+                            if(msecs_since(&sr->deliver_time) >=
+                               search_batch) {
+                                deliver_search_peers(sr, callback, closure);
+                            } else {
+                                struct timeval tv;
+                                add_msecs(&tv, &sr->deliver_time,
+                                          search_batch);
+                                schedule_search(&tv);
+                            }
                         }
                     }
+                    if(!sr->done && search_satisfied(sr))
+                        finish_search(sr, callback, closure);
+                    /* In reply-driven mode, every reply moves the search
+                       forward: check whether the closest nodes have all
+                       replied, and refill the requests in flight. */
+                    else if(search_reply_driven && !sr->done)
+                        search_step(sr, callback, closure);
                 }
-            } else if(tid_match(tid, "ap", &ttid)) {
+            } else if(tid_match(m.tid, "ap", NULL)) {
                 struct search *sr;
                 debugf("Got reply to announce_peer.\n");
-                sr = find_search(ttid, from->sa_family);
+                sr = find_search(sid, from->sa_family);
                 if(!sr) {
                     debugf("Unknown search!\n");
-                    new_node(id, from, fromlen, 1);
+                    new_node(m.id, from, fromlen, 1);
                 } else {
                     int i;
-                    new_node(id, from, fromlen, 2);
+                    new_node(m.id, from, fromlen, 2);
                     for(i = 0; i < sr->numnodes; i++)
-                        if(id_cmp(sr->nodes[i].id, id) == 0) {
-                            sr->nodes[i].request_time = 0;
+                        if(id_cmp(sr->nodes[i].id, m.id) == 0) {
+                            timerclear(&sr->nodes[i].request_time);
                             sr->nodes[i].reply_time = now.tv_sec;
                             sr->nodes[i].acked = 1;
                             sr->nodes[i].pinged = 0;
                             break;
                         }
                     /* See comment for gp above. */
-                    search_send_get_peers(sr, NULL);
+                    if(!search_reply_driven)
+                        search_send_get_peers(sr, NULL);
+                    else if(!sr->done)
+                        search_step(sr, callback, closure);
                 }
             } else {
                 debugf("Unexpected reply: ");
@@ -2075,74 +4052,91 @@ dht_periodic(const void *buf, size_t buflen,
             }
             break;
         case PING:
-            debugf("Ping (%d)!\n", tid_len);
-            new_node(id, from, fromlen, 1);
+            debugf("Ping (%d)!\n", m.tid_len);
+            new_node(m.id, from, fromlen, 1);
             debugf("Sending pong.\n");
-            send_pong(from, fromlen, tid, tid_len);
+            send_pong(from, fromlen, m.tid, m.tid_len);
             break;
         case FIND_NODE:
             debugf("Find node!\n");
-            new_node(id, from, fromlen, 1);
-            debugf("Sending closest nodes (%d).\n", want);
+            new_node(m.id, from, fromlen, 1);
+            debugf("Sending closest nodes (%d).\n", m.want);
             send_closest_nodes(from, fromlen,
-                               tid, tid_len, target, want,
-                               0, NULL, NULL, 0);
+                               m.tid, m.tid_len, m.target, m.want,
+                               0, NULL, 0, 0, NULL, 0);
             break;
         case GET_PEERS:
             debugf("Get_peers!\n");
-            new_node(id, from, fromlen, 1);
-            if(id_cmp(info_hash, zeroes) == 0) {
+            new_node(m.id, from, fromlen, 1);
+            if(id_cmp(m.info_hash, zeroes) == 0) {
                 debugf("Eek!  Got get_peers with no info_hash.\n");
-                send_error(from, fromlen, tid, tid_len,
+                send_error(from, fromlen, m.tid, m.tid_len,
                            203, "Get_peers with no info_hash");
                 break;
             } else {
-                struct storage *st = find_storage(info_hash);
+                struct storage *st = find_storage(m.info_hash);
                 unsigned char token[TOKEN_SIZE];
                 make_token(from, 0, token);
-                if(st && st->numpeers > 0) {
+                if(st)
+                    storage_touch(st);
+                if(st && m.scrape) {
+                    debugf("Sending scrape.\n");
+                    send_closest_nodes(from, fromlen,
+                                       m.tid, m.tid_len, m.info_hash, m.want,
+                                       from->sa_family, st, 1, 0,
+                                       token, TOKEN_SIZE);
+                } else if(st && (from->sa_family == AF_INET ?
+                                 st->peers.numpeers :
+                                 st->peers6.numpeers) > 0) {
                      debugf("Sending found%s peers.\n",
                             from->sa_family == AF_INET6 ? " IPv6" : "");
                      send_closest_nodes(from, fromlen,
-                                        tid, tid_len,
-                                        info_hash, want,
-                                        from->sa_family, st,
+                                        m.tid, m.tid_len,
+                                        m.info_hash, m.want,
+                                        from->sa_family, st, 0, 0,
                                         token, TOKEN_SIZE);
                 } else {
                     debugf("Sending nodes for get_peers.\n");
                     send_closest_nodes(from, fromlen,
-                                       tid, tid_len, info_hash, want,
-                                       0, NULL, token, TOKEN_SIZE);
+                                       m.tid, m.tid_len, m.info_hash, m.want,
+                                       0, NULL, 0, 0, token, TOKEN_SIZE);
                 }
             }
             break;
+        case SAMPLE_INFOHASHES:
+            debugf("Sample infohashes!\n");
+            new_node(m.id, from, fromlen, 1);
+            send_closest_nodes(from, fromlen,
+                               m.tid, m.tid_len, m.target, m.want,
+                               0, NULL, 0, 1, NULL, 0);
+            break;
         case ANNOUNCE_PEER:
             debugf("Announce peer!\n");
-            new_node(id, from, fromlen, 1);
-            if(id_cmp(info_hash, zeroes) == 0) {
+            new_node(m.id, from, fromlen, 1);
+            if(id_cmp(m.info_hash, zeroes) == 0) {
                 debugf("Announce_peer with no info_hash.\n");
-                send_error(from, fromlen, tid, tid_len,
+                send_error(from, fromlen, m.tid, m.tid_len,
                            203, "Announce_peer with no info_hash");
                 break;
             }
-            if(!token_match(token, token_len, from)) {
+            if(!token_match(m.token, m.token_len, from)) {
                 debugf("Incorrect token for announce_peer.\n");
-                send_error(from, fromlen, tid, tid_len,
+                send_error(from, fromlen, m.tid, m.tid_len,
                            203, "Announce_peer with wrong token");
                 break;
             }
-            if(port == 0) {
-                debugf("Announce_peer with forbidden port %d.\n", port);
-                send_error(from, fromlen, tid, tid_len,
+            if(m.port == 0) {
+                debugf("Announce_peer with forbidden port %d.\n", m.port);
+                send_error(from, fromlen, m.tid, m.tid_len,
                            203, "Announce_peer with forbidden port number");
                 break;
             }
-            storage_store(info_hash, from, port);
+            storage_store(m.info_hash, from, m.port, m.seed);
             /* Note that if storage_store failed, we lie to the requestor.
                This is to prevent them from backtracking, and hence
                polluting the DHT. */
             debugf("Sending peer announced.\n");
-            send_peer_announced(from, fromlen, tid, tid_len);
+            send_peer_announced(from, fromlen, m.tid, m.tid_len);
         }
     }
 
@@ -2150,71 +4144,311 @@ dht_periodic(const void *buf, size_t buflen,
     if(now.tv_sec >= rotate_secrets_time)
         rotate_secrets();
 
-    if(now.tv_sec >= expire_stuff_time) {
-        expire_buckets(buckets);
-        expire_buckets(buckets6);
-        expire_storage();
-        expire_searches();
+    if(expire_phase != EXPIRE_IDLE || now.tv_sec >= expire_stuff_time)
+        expire_stuff();
+
+    if(timerisset(&search_time) && msecs_since(&search_time) >= 0) {
+        struct search *sr;
+        if(numpending > 0)
+            start_pending_searches(callback, closure);
+
+        search_starved = 0;
+        sr = searches;
+        while(sr) {
+            if(!sr->done &&
+               (msecs_since(&sr->step_time) >= search_rto(sr) ||
+                (sr->starved && search_budget_left() > 0))) {
+                search_step(sr, callback, closure);
+            }
+            if(search_undelivered(sr) &&
+               msecs_since(&sr->deliver_time) >= search_batch)
+                deliver_search_peers(sr, callback, closure);
+            sr = sr->next;
+        }
+
+        timerclear(&search_time);
+
+        sr = searches;
+        while(sr) {
+            struct timeval tv;
+            if(!sr->done) {
+                add_msecs(&tv, &sr->step_time, search_rto(sr));
+                schedule_search(&tv);
+                if(sr->starved)
+                    search_starved = 1;
+            }
+            if(search_undelivered(sr)) {
+                add_msecs(&tv, &sr->deliver_time, search_batch);
+                schedule_search(&tv);
+            }
+            sr = sr->next;
+        }
+
+        if(numpending > 0) {
+            struct timeval tv;
+            /* If we ran out of search slots, try again in a second. */
+            if(pending_credit >= 1000)
+                add_msecs(&tv, &now, 1000);
+            else
+                add_msecs(&tv, &pending_time,
+                          (1000 - pending_credit + search_rate - 1) /
+                          search_rate);
+            schedule_search(&tv);
+        }
+    }
+
+    if(now.tv_sec >= confirm_nodes_time) {
+        int soon = 0;
+
+        soon |= bucket_maintenance(AF_INET);
+        soon |= bucket_maintenance(AF_INET6);
+
+        if(!soon) {
+            if(mybucket_grow_time >= now.tv_sec - 150)
+                soon |= neighbourhood_maintenance(AF_INET);
+            if(mybucket6_grow_time >= now.tv_sec - 150)
+                soon |= neighbourhood_maintenance(AF_INET6);
+        }
+
+        /* In order to maintain all buckets' age within 600 seconds, worst
+           case is roughly 27 seconds, assuming the table is 22 bits deep.
+           We want to keep a margin for neighborhood maintenance, so keep
+           this within 25 seconds. */
+        if(soon)
+            confirm_nodes_time = now.tv_sec + 5 + dht_random() % 20;
+        else
+            confirm_nodes_time = now.tv_sec + 60 + dht_random() % 120;
+    }
+
+    if(confirm_nodes_time > now.tv_sec) {
+        *tosleep = confirm_nodes_time - now.tv_sec;
+        wakeup_time.tv_sec = confirm_nodes_time;
+        wakeup_time.tv_usec = 0;
+    } else {
+        *tosleep = 0;
+        wakeup_time = now;
+    }
+
+    if(timerisset(&search_time)) {
+        if(msecs_since(&search_time) >= 0)
+            *tosleep = 0;
+        else if(*tosleep > search_time.tv_sec - now.tv_sec)
+            *tosleep = search_time.tv_sec - now.tv_sec;
+        if(timercmp(&search_time, &wakeup_time, <))
+            wakeup_time = search_time;
+    }
+
+    if(expire_phase != EXPIRE_IDLE) {
+        struct timeval tv;
+        *tosleep = 0;
+        add_msecs(&tv, &now, DHT_EXPIRE_INTERVAL);
+        if(timercmp(&tv, &wakeup_time, <))
+            wakeup_time = tv;
+    }
+
+    send_flush();
+    {
+        struct timeval tv;
+        if(send_wakeup(&tv)) {
+            *tosleep = 0;
+            if(timercmp(&tv, &wakeup_time, <))
+                wakeup_time = tv;
+        }
+    }
+
+    return 1;
+}
+
+void
+dht_timeout(struct timeval *tv_return)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    if(!timercmp(&tv, &wakeup_time, <)) {
+        tv_return->tv_sec = 0;
+        tv_return->tv_usec = 0;
+    } else {
+        tv_return->tv_sec = wakeup_time.tv_sec - tv.tv_sec;
+        tv_return->tv_usec = wakeup_time.tv_usec - tv.tv_usec;
+        if(tv_return->tv_usec < 0) {
+            tv_return->tv_sec--;
+            tv_return->tv_usec += 1000000;
+        }
+    }
+}
+
+int
+dht_set_option(int option, int value)
+{
+    switch(option) {
+    case DHT_OPT_MIN_TIMEOUT:
+        if(value < 1 || value > max_timeout)
+            goto fail;
+        min_timeout = value;
+        break;
+    case DHT_OPT_MAX_TIMEOUT:
+        if(value < 1 || value < min_timeout)
+            goto fail;
+        max_timeout = value;
+        break;
+    case DHT_OPT_SEARCH_ALPHA:
+        if(value < 1 || value > search_max_alpha)
+            goto fail;
+        search_alpha = value;
+        break;
+    case DHT_OPT_SEARCH_MAX_ALPHA:
+        if(value < 1 || value < search_alpha)
+            goto fail;
+        search_max_alpha = value;
+        break;
+    case DHT_OPT_SEARCH_REPLY_DRIVEN:
+        search_reply_driven = !!value;
+        break;
+    case DHT_OPT_SEARCH_BATCH:
+        if(value < 0)
+            goto fail;
+        search_batch = value;
+        break;
+    case DHT_OPT_SEARCH_RATE:
+        if(value <= 0 || value > 100000)
+            goto fail;
+        search_rate = value;
+        break;
+    case DHT_OPT_SEARCH_BUDGET:
+        if(value < 0)
+            goto fail;
+        search_budget = value;
+        break;
+    case DHT_OPT_SEARCH_CACHE_TTL:
+        if(value < 0 || value > DHT_SEARCH_EXPIRE_TIME)
+            goto fail;
+        search_cache_ttl = value;
+        break;
+    case DHT_OPT_SEARCH_CACHE_REFRESH:
+        search_cache_refresh = !!value;
+        break;
+    case DHT_OPT_STORAGE_BUDGET:
+        if(value < 0)
+            goto fail;
+        storage_budget = value;
+        storage_evict(NULL, 0);
+        break;
+    case DHT_OPT_MAX_HASHES:
+        if(value < 0)
+            goto fail;
+        storage_max_hashes = value;
+        storage_evict(NULL, 0);
+        break;
+    case DHT_OPT_MAX_PEERS:
+        if(value < 0 || value > DHT_MAX_PEERS)
+            goto fail;
+        storage_max_peers = value;
+        break;
+    case DHT_OPT_REQUEST_RATE:
+        if(value <= 0 || value > 1000000)
+            goto fail;
+        request_rate = value;
+        token_bucket_tokens = MIN(token_bucket_tokens, RATE_BURST * value);
+        break;
+    case DHT_OPT_PREFIX_RATE:
+        if(value < 0 || value > 1000000)
+            goto fail;
+        prefix_limit.rate = value;
+        break;
+    case DHT_OPT_ANNOUNCE_RATE:
+        if(value < 0 || value > 1000000)
+            goto fail;
+        announce_limit.rate = value;
+        break;
+    case DHT_OPT_SHED_LOAD:
+        if(value < 0 || value > 100)
+            goto fail;
+        shed_load = value;
+        break;
+    case DHT_OPT_SEND_RATE:
+        if(value < 0 || value > 1000000)
+            goto fail;
+        send_rate = value;
+        break;
+    default:
+        goto fail;
     }
+    return 1;
 
-    if(search_time > 0 && now.tv_sec >= search_time) {
-        struct search *sr;
-        sr = searches;
-        while(sr) {
-            if(!sr->done && sr->step_time + 5 <= now.tv_sec) {
-                search_step(sr, callback, closure);
-            }
-            sr = sr->next;
-        }
-
-        search_time = 0;
+ fail:
+    errno = EINVAL;
+    return -1;
+}
 
-        sr = searches;
-        while(sr) {
-            if(!sr->done) {
-                time_t tm = sr->step_time + 15 + random() % 10;
-                if(search_time == 0 || search_time > tm)
-                    search_time = tm;
-            }
-            sr = sr->next;
-        }
+int
+dht_get_option(int option)
+{
+    switch(option) {
+    case DHT_OPT_MIN_TIMEOUT: return min_timeout;
+    case DHT_OPT_MAX_TIMEOUT: return max_timeout;
+    case DHT_OPT_SEARCH_ALPHA: return search_alpha;
+    case DHT_OPT_SEARCH_MAX_ALPHA: return search_max_alpha;
+    case DHT_OPT_SEARCH_REPLY_DRIVEN: return search_reply_driven;
+    case DHT_OPT_SEARCH_BATCH: return search_batch;
+    case DHT_OPT_SEARCH_RATE: return search_rate;
+    case DHT_OPT_SEARCH_BUDGET: return search_budget;
+    case DHT_OPT_SEARCH_CACHE_TTL: return search_cache_ttl;
+    case DHT_OPT_SEARCH_CACHE_REFRESH: return search_cache_refresh;
+    case DHT_OPT_STORAGE_BUDGET: return storage_budget;
+    case DHT_OPT_MAX_HASHES: return storage_max_hashes;
+    case DHT_OPT_MAX_PEERS: return storage_max_peers;
+    case DHT_OPT_REQUEST_RATE: return request_rate;
+    case DHT_OPT_PREFIX_RATE: return prefix_limit.rate;
+    case DHT_OPT_ANNOUNCE_RATE: return announce_limit.rate;
+    case DHT_OPT_SHED_LOAD: return shed_load;
+    case DHT_OPT_SEND_RATE: return send_rate;
+    default:
+        errno = EINVAL;
+        return -1;
     }
+}
 
-    if(now.tv_sec >= confirm_nodes_time) {
-        int soon = 0;
-
-        soon |= bucket_maintenance(AF_INET);
-        soon |= bucket_maintenance(AF_INET6);
-
-        if(!soon) {
-            if(mybucket_grow_time >= now.tv_sec - 150)
-                soon |= neighbourhood_maintenance(AF_INET);
-            if(mybucket6_grow_time >= now.tv_sec - 150)
-                soon |= neighbourhood_maintenance(AF_INET6);
-        }
+/* Report how full the receive queue is, in percent. */
+void
+dht_set_load(int value)
+{
+    load = MAX(0, MIN(100, value));
+}
 
-        /* In order to maintain all buckets' age within 600 seconds, worst
-           case is roughly 27 seconds, assuming the table is 22 bits deep.
-           We want to keep a margin for neighborhood maintenance, so keep
-           this within 25 seconds. */
-        if(soon)
-            confirm_nodes_time = now.tv_sec + 5 + random() % 20;
-        else
-            confirm_nodes_time = now.tv_sec + 60 + random() % 120;
+int
+dht_message_stats(int type, unsigned long *received_return,
+                  unsigned long *limited_return, unsigned long *shed_return)
+{
+    if(type < REPLY || type > SAMPLE_INFOHASHES) {
+        errno = EINVAL;
+        return -1;
     }
 
-    if(confirm_nodes_time > now.tv_sec)
-        *tosleep = confirm_nodes_time - now.tv_sec;
-    else
-        *tosleep = 0;
+    if(received_return)
+        *received_return = message_stats[type].received;
+    if(limited_return)
+        *limited_return = message_stats[type].limited;
+    if(shed_return)
+        *shed_return = message_stats[type].shed;
+    return 1;
+}
 
-    if(search_time > 0) {
-        if(search_time <= now.tv_sec)
-            *tosleep = 0;
-        else if(*tosleep > search_time - now.tv_sec)
-            *tosleep = search_time - now.tv_sec;
+int
+dht_send_stats(int class, unsigned long *sent_return,
+               unsigned long *deferred_return, unsigned long *dropped_return)
+{
+    if(class < 0 || class >= SEND_CLASSES) {
+        errno = EINVAL;
+        return -1;
     }
 
+    if(sent_return)
+        *sent_return = send_queues[class].sent;
+    if(deferred_return)
+        *deferred_return = send_queues[class].deferred;
+    if(dropped_return)
+        *dropped_return = send_queues[class].dropped;
     return 1;
 }
 
@@ -2317,35 +4551,273 @@ dht_ping_node(struct sockaddr *sa, int salen)
     unsigned char tid[4];
 
     debugf("Sending ping.\n");
-    make_tid(tid, "pn", 0);
+    if(new_transaction(tid, "pn", NULL, sa, salen, 0) < 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
     return send_ping(sa, salen, tid, 4);
 }
 
 /* We could use a proper bencoding printer and parser, but the format of
-   DHT messages is fairly stylised, so this seemed simpler. */
+   DHT messages is fairly stylised, so this seemed simpler.  Messages are
+   assembled from literal keys, the templates built by dht_init, and
+   integers printed by dht_itoa. */
 
 #define CHECK(offset, delta, size)                      \
     if(delta < 0 || offset + delta > size) goto fail
 
-#define INC(offset, delta, size)                        \
-    CHECK(offset, delta, size);                         \
-    offset += delta
-
 #define COPY(buf, offset, src, delta, size)             \
     CHECK(offset, delta, size);                         \
     memcpy(buf + offset, src, delta);                   \
     offset += delta;
 
-#define ADD_V(buf, offset, size)                        \
-    if(have_v) {                                        \
-        COPY(buf, offset, my_v, sizeof(my_v), size);    \
+/* A literal string, without its terminating NUL. */
+#define ADD_LIT(buf, offset, lit, size)                 \
+    COPY(buf, offset, lit, (int)sizeof(lit) - 1, size)
+
+/* An unsigned integer, in decimal. */
+#define ADD_INT(buf, offset, v, size)                   \
+    CHECK(offset, 10, size);                            \
+    offset += dht_itoa(buf + offset, v)
+
+/* A string, preceded by its length. */
+#define ADD_STRING(buf, offset, src, len, size)         \
+    ADD_INT(buf, offset, len, size);                    \
+    ADD_LIT(buf, offset, ":", size);                    \
+    COPY(buf, offset, src, len, size)
+
+#define ADD_WANT(buf, offset, want, size)               \
+    if(want > 0) {                                      \
+        ADD_LIT(buf, offset, "4:wantl", size);          \
+        if(want & WANT4) {                              \
+            ADD_LIT(buf, offset, "2:n4", size);         \
+        }                                               \
+        if(want & WANT6) {                              \
+            ADD_LIT(buf, offset, "2:n6", size);         \
+        }                                               \
+        ADD_LIT(buf, offset, "e", size);                \
+    }
+
+/* The transaction id, our version, and the type of the message. */
+#define ADD_TAIL(buf, offset, tid, tid_len, tail, size) \
+    ADD_LIT(buf, offset, "1:t", size);                  \
+    ADD_STRING(buf, offset, tid, tid_len, size);        \
+    COPY(buf, offset, tail, tail_len, size)
+
+static int
+dht_itoa(char *buf, unsigned int v)
+{
+    char tmp[10];
+    int i, n = 0;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while(v > 0);
+    for(i = 0; i < n; i++)
+        buf[i] = tmp[n - 1 - i];
+    return n;
+}
+
+static int
+send_socket(int af)
+{
+    if(af == AF_INET)
+        return dht_socket;
+    else if(af == AF_INET6)
+        return dht_socket6;
+    else
+        return -1;
+}
+
+/* Take a send token, or return 0 if there is none left. */
+static int
+send_token(void)
+{
+    int64_t t, interval, burst;
+
+    if(send_rate <= 0)
+        return 1;
+
+    t = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    interval = 1000000 / send_rate;
+    burst = MAX(SEND_BURST * 1000, interval);
+    if(send_next - t > burst - interval)
+        return 0;
+
+    send_next = MAX(send_next, t) + interval;
+    return 1;
+}
+
+/* Give back a token that we took but could not use. */
+static void
+send_untoken(void)
+{
+    if(send_rate > 0)
+        send_next -= 1000000 / send_rate;
+}
+
+/* Whether any packet is waiting in the queues. */
+static int
+send_pending(void)
+{
+    int i;
+
+    for(i = 0; i < SEND_CLASSES; i++)
+        if(send_queues[i].count > 0)
+            return 1;
+    return 0;
+}
+
+static int
+send_blocked(int err)
+{
+    return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+static int
+send_enqueue(int class, const void *buf, size_t len, int flags,
+             const unsigned char *tid, const struct sockaddr *sa, int salen)
+{
+    struct send_queue *q = &send_queues[class];
+    struct outbound *o;
+
+    if(q->count >= SEND_QUEUE_LEN) {
+        q->dropped++;
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    o = malloc(sizeof(struct outbound) + len);
+    if(o == NULL) {
+        q->dropped++;
+        return -1;
+    }
+    o->time = now;
+    memcpy(&o->ss, sa, salen);
+    o->sslen = salen;
+    o->flags = flags;
+    o->tid_len = tid ? 4 : 0;
+    if(tid)
+        memcpy(o->tid, tid, 4);
+    o->len = len;
+    memcpy(o->buf, buf, len);
+
+    q->packets[(q->first + q->count) % SEND_QUEUE_LEN] = o;
+    q->count++;
+    q->deferred++;
+
+    /* We may have been called from outside dht_periodic, make sure that
+       dht_timeout wakes our caller up in time to send it. */
+    {
+        struct timeval tv;
+        if(send_wakeup(&tv) && timercmp(&tv, &wakeup_time, <))
+            wakeup_time = tv;
+    }
+    /* As far as the caller is concerned, the packet is on its way. */
+    return len;
+}
+
+static void
+send_dequeue(struct send_queue *q)
+{
+    free(q->packets[q->first]);
+    q->first = (q->first + 1) % SEND_QUEUE_LEN;
+    q->count--;
+}
+
+/* Send queued packets for as long as there are tokens. */
+static void
+send_flush(void)
+{
+    struct send_queue *q;
+    struct outbound *o;
+    int i, rc, pending;
+
+    while(1) {
+        pending = 0;
+        for(i = 0; i < SEND_CLASSES; i++) {
+            q = &send_queues[i];
+            while(q->count > 0 && q->credit > 0) {
+                o = q->packets[q->first];
+                if(msecs_since(&o->time) > SEND_QUEUE_AGE) {
+                    q->dropped++;
+                    if(o->tid_len > 0)
+                        transaction_dropped(o->tid,
+                                            (struct sockaddr*)&o->ss, 1);
+                    send_dequeue(q);
+                    continue;
+                }
+                if(!send_token())
+                    return;
+                rc = sendto(send_socket(o->ss.ss_family), o->buf, o->len,
+                            o->flags, (struct sockaddr*)&o->ss, o->sslen);
+                if(rc < 0 && send_blocked(errno)) {
+                    send_untoken();
+                    return;
+                }
+                if(rc < 0) {
+                    q->dropped++;
+                    if(o->tid_len > 0)
+                        transaction_dropped(o->tid,
+                                            (struct sockaddr*)&o->ss, 1);
+                } else {
+                    q->sent++;
+                }
+                send_dequeue(q);
+                q->credit--;
+            }
+            if(q->count > 0)
+                pending = 1;
+        }
+        if(!pending)
+            return;
+        /* Every class has used its share, start a new round. */
+        for(i = 0; i < SEND_CLASSES; i++)
+            send_queues[i].credit = send_weight[i];
+    }
+}
+
+/* If packets are waiting, return when the next one can go. */
+static int
+send_wakeup(struct timeval *tv_return)
+{
+    int64_t t;
+
+    if(!send_pending())
+        return 0;
+
+    /* Don't spin while the kernel has no room for us. */
+    t = (int64_t)now.tv_sec * 1000000 + now.tv_usec + 1000;
+    if(send_rate > 0) {
+        int64_t interval = 1000000 / send_rate;
+        t = MAX(t, send_next - (MAX(SEND_BURST * 1000, interval) - interval));
     }
+    tv_return->tv_sec = t / 1000000;
+    tv_return->tv_usec = t % 1000000;
+    return 1;
+}
+
+static void
+send_queues_clear(void)
+{
+    int i;
 
+    for(i = 0; i < SEND_CLASSES; i++)
+        while(send_queues[i].count > 0)
+            send_dequeue(&send_queues[i]);
+}
+
+/* Send a packet, or queue it for later.  Requests pass their tid, so
+   that their transaction is closed if the packet is dropped; when that
+   happens here, we return -1 and the caller must not count it as a
+   ping. */
 static int
-dht_send(const void *buf, size_t len, int flags,
-         const struct sockaddr *sa, int salen)
+dht_send(const void *buf, size_t len, int flags, int class,
+         const unsigned char *tid, const struct sockaddr *sa, int salen)
 {
-    int s;
+    struct send_queue *q = &send_queues[class];
+    int s, rc, err;
 
     if(salen == 0)
         abort();
@@ -2353,22 +4825,41 @@ dht_send(const void *buf, size_t len, int flags,
     if(node_blacklisted(sa, salen)) {
         debugf("Attempting to send to blacklisted node.\n");
         errno = EPERM;
-        return -1;
+        goto fail;
     }
 
-    if(sa->sa_family == AF_INET)
-        s = dht_socket;
-    else if(sa->sa_family == AF_INET6)
-        s = dht_socket6;
-    else
-        s = -1;
-
+    s = send_socket(sa->sa_family);
     if(s < 0) {
         errno = EAFNOSUPPORT;
-        return -1;
+        goto fail;
     }
 
-    return sendto(s, buf, len, flags, sa, salen);
+    /* Only skip the queues when they are all empty, so that packets go
+       out in the order of the round robin. */
+    if(!send_pending() && send_token()) {
+        rc = sendto(s, buf, len, flags, sa, salen);
+        if(rc >= 0) {
+            q->sent++;
+            return rc;
+        }
+        if(!send_blocked(errno)) {
+            q->dropped++;
+            goto fail;
+        }
+        send_untoken();
+    }
+
+    rc = send_enqueue(class, buf, len, flags, tid, sa, salen);
+    if(rc < 0)
+        goto fail;
+    return rc;
+
+ fail:
+    err = errno;
+    if(tid)
+        transaction_dropped(tid, sa, 0);
+    errno = err;
+    return -1;
 }
 
 int
@@ -2376,15 +4867,12 @@ send_ping(const struct sockaddr *sa, int salen,
           const unsigned char *tid, int tid_len)
 {
     char buf[512];
-    int i = 0, rc;
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:q4:ping1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    int i = 0;
+    COPY(buf, i, query_head, 32, 512);
+    ADD_LIT(buf, i, "e1:q4:ping", 512);
+    ADD_TAIL(buf, i, tid, tid_len, query_tail, 512);
+    return dht_send(buf, i, 0, DHT_SEND_MAINTENANCE,
+                    tid_len == 4 ? tid : NULL, sa, salen);
 
  fail:
     errno = ENOSPC;
@@ -2396,14 +4884,11 @@ send_pong(const struct sockaddr *sa, int salen,
           const unsigned char *tid, int tid_len)
 {
     char buf[512];
-    int i = 0, rc;
-    rc = snprintf(buf + i, 512 - i, "d1:rd2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len); INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    int i = 0;
+    COPY(buf, i, reply_head, 32, 512);
+    ADD_LIT(buf, i, "e", 512);
+    ADD_TAIL(buf, i, tid, tid_len, reply_tail, 512);
+    return dht_send(buf, i, 0, DHT_SEND_REPLY, NULL, sa, salen);
 
  fail:
     errno = ENOSPC;
@@ -2416,23 +4901,15 @@ send_find_node(const struct sockaddr *sa, int salen,
                const unsigned char *target, int want, int confirm)
 {
     char buf[512];
-    int i = 0, rc;
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "6:target20:"); INC(i, rc, 512);
+    int i = 0;
+    COPY(buf, i, query_head, 32, 512);
+    ADD_LIT(buf, i, "6:target20:", 512);
     COPY(buf, i, target, 20, 512);
-    if(want > 0) {
-        rc = snprintf(buf + i, 512 - i, "4:wantl%s%se",
-                      (want & WANT4) ? "2:n4" : "",
-                      (want & WANT6) ? "2:n6" : "");
-        INC(i, rc, 512);
-    }
-    rc = snprintf(buf + i, 512 - i, "e1:q9:find_node1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
+    ADD_WANT(buf, i, want, 512);
+    ADD_LIT(buf, i, "e1:q9:find_node", 512);
+    ADD_TAIL(buf, i, tid, tid_len, query_tail, 512);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, DHT_SEND_MAINTENANCE,
+                    tid_len == 4 ? tid : NULL, sa, salen);
 
  fail:
     errno = ENOSPC;
@@ -2444,62 +4921,89 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
                  const unsigned char *tid, int tid_len,
                  const unsigned char *nodes, int nodes_len,
                  const unsigned char *nodes6, int nodes6_len,
-                 int af, struct storage *st,
+                 int af, struct storage *st, int scrape, int sample,
                  const unsigned char *token, int token_len)
 {
     char buf[2048];
-    int i = 0, rc, j0, j, k, len;
-
-    rc = snprintf(buf + i, 2048 - i, "d1:rd2:id20:"); INC(i, rc, 2048);
-    COPY(buf, i, myid, 20, 2048);
+    int i = 0, j, k, n, rec;
+    struct peerset *ps = NULL;
+    struct values *v = NULL;
+    unsigned char *bloom = NULL;
+
+    if(st && scrape)
+        bloom = storage_bloom(st);
+
+    if(bloom) {
+        /* A scrape gets the bloom filters of BEP 33 instead of values.
+           They sort before the id, so the reply template is split. */
+        ADD_LIT(buf, i, "d1:rd4:BFpe256:", 2048);
+        COPY(buf, i, bloom + BLOOM_SIZE, BLOOM_SIZE, 2048);
+        ADD_LIT(buf, i, "4:BFsd256:", 2048);
+        COPY(buf, i, bloom, BLOOM_SIZE, 2048);
+        COPY(buf, i, reply_head + 5, 27, 2048);
+    } else {
+        COPY(buf, i, reply_head, 32, 2048);
+    }
+    if(sample) {
+        ADD_LIT(buf, i, "8:intervali", 2048);
+        ADD_INT(buf, i, DHT_SAMPLE_INTERVAL, 2048);
+        ADD_LIT(buf, i, "e", 2048);
+    }
     if(nodes_len > 0) {
-        rc = snprintf(buf + i, 2048 - i, "5:nodes%d:", nodes_len);
-        INC(i, rc, 2048);
-        COPY(buf, i, nodes, nodes_len, 2048);
+        ADD_LIT(buf, i, "5:nodes", 2048);
+        ADD_STRING(buf, i, nodes, nodes_len, 2048);
     }
     if(nodes6_len > 0) {
-         rc = snprintf(buf + i, 2048 - i, "6:nodes6%d:", nodes6_len);
-         INC(i, rc, 2048);
-         COPY(buf, i, nodes6, nodes6_len, 2048);
+        ADD_LIT(buf, i, "6:nodes6", 2048);
+        ADD_STRING(buf, i, nodes6, nodes6_len, 2048);
+    }
+    if(sample) {
+        /* As many samples as fit within DHT_REPLY_SIZE, leaving room
+           for their keys and for the end of the reply. */
+        n = (DHT_REPLY_SIZE - i - 40 - 32 - tid_len) / 20;
+        n = MAX(MIN(n, numstorage), 0);
+        ADD_LIT(buf, i, "3:numi", 2048);
+        ADD_INT(buf, i, numstorage, 2048);
+        ADD_LIT(buf, i, "e7:samples", 2048);
+        ADD_INT(buf, i, n * 20, 2048);
+        ADD_LIT(buf, i, ":", 2048);
+        CHECK(i, n * 20, 2048);
+        n = storage_sample((unsigned char*)buf + i, n);
+        i += n * 20;
     }
     if(token_len > 0) {
-        rc = snprintf(buf + i, 2048 - i, "5:token%d:", token_len);
-        INC(i, rc, 2048);
-        COPY(buf, i, token, token_len, 2048);
+        ADD_LIT(buf, i, "5:token", 2048);
+        ADD_STRING(buf, i, token, token_len, 2048);
     }
 
-    if(st && st->numpeers > 0) {
-        /* We treat the storage as a circular list, and serve a randomly
-           chosen slice.  In order to make sure we fit within 1024 octets,
-           we limit ourselves to 50 peers. */
-
-        len = af == AF_INET ? 4 : 16;
-        j0 = random() % st->numpeers;
-        j = j0;
-        k = 0;
+    if(st && !scrape) {
+        ps = af == AF_INET ? &st->peers : &st->peers6;
+        if(ps->numpeers > 0)
+            v = storage_values(st, af);
+    }
 
-        rc = snprintf(buf + i, 2048 - i, "6:valuesl"); INC(i, rc, 2048);
-        do {
-            if(st->peers[j].len == len) {
-                unsigned short swapped;
-                swapped = htons(st->peers[j].port);
-                rc = snprintf(buf + i, 2048 - i, "%d:", len + 2);
-                INC(i, rc, 2048);
-                COPY(buf, i, st->peers[j].ip, len, 2048);
-                COPY(buf, i, &swapped, 2, 2048);
-                k++;
-            }
-            j = (j + 1) % st->numpeers;
-        } while(j != j0 && k < 50);
-        rc = snprintf(buf + i, 2048 - i, "e"); INC(i, rc, 2048);
+    if(v) {
+        /* We treat the storage as a circular list, and serve a randomly
+           chosen slice of its encoded peers, as many as fit within
+           DHT_REPLY_SIZE once the rest of the reply (at most 32 octets
+           besides the tid) is accounted for. */
+
+        rec = af == AF_INET ? 8 : 21;
+        n = (DHT_REPLY_SIZE - i - 9 - 32 - tid_len) / rec;
+        n = MAX(MIN(n, ps->numpeers), 1);
+        j = dht_random() % ps->numpeers;
+        k = MIN(n, ps->numpeers - j);
+
+        ADD_LIT(buf, i, "6:valuesl", 2048);
+        COPY(buf, i, v->data + j * rec, k * rec, 2048);
+        COPY(buf, i, v->data, (n - k) * rec, 2048);
+        ADD_LIT(buf, i, "e", 2048);
     }
 
-    rc = snprintf(buf + i, 2048 - i, "e1:t%d:", tid_len); INC(i, rc, 2048);
-    COPY(buf, i, tid, tid_len, 2048);
-    ADD_V(buf, i, 2048);
-    rc = snprintf(buf + i, 2048 - i, "1:y1:re"); INC(i, rc, 2048);
+    ADD_LIT(buf, i, "e", 2048);
+    ADD_TAIL(buf, i, tid, tid_len, reply_tail, 2048);
 
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, DHT_SEND_REPLY, NULL, sa, salen);
 
  fail:
     errno = ENOSPC;
@@ -2570,7 +5074,7 @@ int
 send_closest_nodes(const struct sockaddr *sa, int salen,
                    const unsigned char *tid, int tid_len,
                    const unsigned char *id, int want,
-                   int af, struct storage *st,
+                   int af, struct storage *st, int scrape, int sample,
                    const unsigned char *token, int token_len)
 {
     unsigned char nodes[8 * 26];
@@ -2610,33 +5114,50 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
     return send_nodes_peers(sa, salen, tid, tid_len,
                             nodes, numnodes * 26,
                             nodes6, numnodes6 * 38,
-                            af, st, token, token_len);
+                            af, st, scrape, sample, token, token_len);
 }
 
 int
 send_get_peers(const struct sockaddr *sa, int salen,
                unsigned char *tid, int tid_len, unsigned char *infohash,
-               int want, int confirm)
+               int want, int scrape, int confirm)
 {
     char buf[512];
-    int i = 0, rc;
+    int i = 0;
 
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "9:info_hash20:"); INC(i, rc, 512);
+    COPY(buf, i, query_head, 32, 512);
+    ADD_LIT(buf, i, "9:info_hash20:", 512);
     COPY(buf, i, infohash, 20, 512);
-    if(want > 0) {
-        rc = snprintf(buf + i, 512 - i, "4:wantl%s%se",
-                      (want & WANT4) ? "2:n4" : "",
-                      (want & WANT6) ? "2:n6" : "");
-        INC(i, rc, 512);
-    }
-    rc = snprintf(buf + i, 512 - i, "e1:q9:get_peers1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
+    if(scrape) {
+        ADD_LIT(buf, i, "6:scrapei1e", 512);
+    }
+    ADD_WANT(buf, i, want, 512);
+    ADD_LIT(buf, i, "e1:q9:get_peers", 512);
+    ADD_TAIL(buf, i, tid, tid_len, query_tail, 512);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, DHT_SEND_SEARCH,
+                    tid_len == 4 ? tid : NULL, sa, salen);
+
+ fail:
+    errno = ENOSPC;
+    return -1;
+}
+
+int
+send_sample_infohashes(const struct sockaddr *sa, int salen,
+                       unsigned char *tid, int tid_len,
+                       unsigned char *target, int want, int confirm)
+{
+    char buf[512];
+    int i = 0;
+
+    COPY(buf, i, query_head, 32, 512);
+    ADD_LIT(buf, i, "6:target20:", 512);
+    COPY(buf, i, target, 20, 512);
+    ADD_WANT(buf, i, want, 512);
+    ADD_LIT(buf, i, "e1:q17:sample_infohashes", 512);
+    ADD_TAIL(buf, i, tid, tid_len, query_tail, 512);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, DHT_SEND_SEARCH,
+                    tid_len == 4 ? tid : NULL, sa, salen);
 
  fail:
     errno = ENOSPC;
@@ -2650,23 +5171,20 @@ send_announce_peer(const struct sockaddr *sa, int salen,
                    unsigned char *token, int token_len, int confirm)
 {
     char buf[512];
-    int i = 0, rc;
+    int i = 0;
 
-    rc = snprintf(buf + i, 512 - i, "d1:ad2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "9:info_hash20:"); INC(i, rc, 512);
+    COPY(buf, i, query_head, 32, 512);
+    ADD_LIT(buf, i, "9:info_hash20:", 512);
     COPY(buf, i, infohash, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "4:porti%ue5:token%d:", (unsigned)port,
-                  token_len);
-    INC(i, rc, 512);
-    COPY(buf, i, token, token_len, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:q13:announce_peer1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-
-    return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, sa, salen);
+    ADD_LIT(buf, i, "4:porti", 512);
+    ADD_INT(buf, i, port, 512);
+    ADD_LIT(buf, i, "e5:token", 512);
+    ADD_STRING(buf, i, token, token_len, 512);
+    ADD_LIT(buf, i, "e1:q13:announce_peer", 512);
+    ADD_TAIL(buf, i, tid, tid_len, query_tail, 512);
+
+    return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, DHT_SEND_SEARCH,
+                    tid_len == 4 ? tid : NULL, sa, salen);
 
  fail:
     errno = ENOSPC;
@@ -2678,16 +5196,12 @@ send_peer_announced(const struct sockaddr *sa, int salen,
                     unsigned char *tid, int tid_len)
 {
     char buf[512];
-    int i = 0, rc;
+    int i = 0;
 
-    rc = snprintf(buf + i, 512 - i, "d1:rd2:id20:"); INC(i, rc, 512);
-    COPY(buf, i, myid, 20, 512);
-    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len);
-    INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    COPY(buf, i, reply_head, 32, 512);
+    ADD_LIT(buf, i, "e", 512);
+    ADD_TAIL(buf, i, tid, tid_len, reply_tail, 512);
+    return dht_send(buf, i, 0, DHT_SEND_REPLY, NULL, sa, salen);
 
  fail:
     errno = ENOSPC;
@@ -2700,17 +5214,15 @@ send_error(const struct sockaddr *sa, int salen,
            int code, const char *message)
 {
     char buf[512];
-    int i = 0, rc;
-
-    rc = snprintf(buf + i, 512 - i, "d1:eli%de%d:",
-                  code, (int)strlen(message));
-    INC(i, rc, 512);
-    COPY(buf, i, message, (int)strlen(message), 512);
-    rc = snprintf(buf + i, 512 - i, "e1:t%d:", tid_len); INC(i, rc, 512);
-    COPY(buf, i, tid, tid_len, 512);
-    ADD_V(buf, i, 512);
-    rc = snprintf(buf + i, 512 - i, "1:y1:ee"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    int i = 0;
+
+    ADD_LIT(buf, i, "d1:eli", 512);
+    ADD_INT(buf, i, code, 512);
+    ADD_LIT(buf, i, "e", 512);
+    ADD_STRING(buf, i, message, (int)strlen(message), 512);
+    ADD_LIT(buf, i, "e", 512);
+    ADD_TAIL(buf, i, tid, tid_len, error_tail, 512);
+    return dht_send(buf, i, 0, DHT_SEND_REPLY, NULL, sa, salen);
 
  fail:
     errno = ENOSPC;
@@ -2718,252 +5230,302 @@ send_error(const struct sockaddr *sa, int salen,
 }
 
 #undef CHECK
-#undef INC
 #undef COPY
-#undef ADD_V
+#undef ADD_LIT
+#undef ADD_INT
+#undef ADD_STRING
+#undef ADD_WANT
+#undef ADD_TAIL
+
+/* The parser below walks the message once, from left to right, and never
+   looks past buf + buflen.  Each helper takes the current position and
+   returns the position just after what it consumed, or NULL if the
+   input is malformed or truncated. */
+
+#define MAX_DEPTH 16
+
+#define KEY(k, klen, name) \
+    ((klen) == sizeof(name) - 1 && memcmp((k), (name), sizeof(name) - 1) == 0)
+
+/* Parse a string, returning a pointer to its contents in *s_return. */
+static const unsigned char *
+bstring(const unsigned char *p, const unsigned char *end,
+        const unsigned char **s_return, int *len_return)
+{
+    int len = 0;
 
-#ifdef HAVE_MEMMEM
+    if(p >= end || *p < '0' || *p > '9')
+        return NULL;
+    while(p < end && *p >= '0' && *p <= '9') {
+        len = len * 10 + (*p - '0');
+        /* This also prevents len from overflowing. */
+        if(len > end - p)
+            return NULL;
+        p++;
+    }
+    if(p >= end || *p != ':')
+        return NULL;
+    p++;
+    if(len > end - p)
+        return NULL;
+    *s_return = p;
+    *len_return = len;
+    return p + len;
+}
 
-static void *
-dht_memmem(const void *haystack, size_t haystacklen,
-           const void *needle, size_t needlelen)
+/* Parse an integer.  Values too large for us to care about saturate. */
+static const unsigned char *
+bint(const unsigned char *p, const unsigned char *end, long *value_return)
 {
-    return memmem(haystack, haystacklen, needle, needlelen);
-}
+    long v = 0;
+    int neg = 0;
 
-#else
+    if(p >= end || *p != 'i')
+        return NULL;
+    p++;
+    if(p < end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    if(p >= end || *p < '0' || *p > '9')
+        return NULL;
+    while(p < end && *p >= '0' && *p <= '9') {
+        v = v < 100000000 ? v * 10 + (*p - '0') : 1000000000;
+        p++;
+    }
+    if(p >= end || *p != 'e')
+        return NULL;
+    *value_return = neg ? -v : v;
+    return p + 1;
+}
 
-static void *
-dht_memmem(const void *haystack, size_t haystacklen,
-           const void *needle, size_t needlelen)
+/* Skip a value of any type. */
+static const unsigned char *
+bskip(const unsigned char *p, const unsigned char *end, int depth)
 {
-    const char *h = haystack;
-    const char *n = needle;
-    size_t i;
+    const unsigned char *s;
+    int len;
+    long v;
 
-    /* size_t is unsigned */
-    if(needlelen > haystacklen)
+    if(p >= end || depth > MAX_DEPTH)
         return NULL;
+    switch(*p) {
+    case 'i':
+        return bint(p, end, &v);
+    case 'l':
+    case 'd':
+        p++;
+        while(p < end && *p != 'e') {
+            p = bskip(p, end, depth + 1);
+            if(p == NULL)
+                return NULL;
+        }
+        return p < end ? p + 1 : NULL;
+    default:
+        return bstring(p, end, &s, &len);
+    }
+}
 
-    for(i = 0; i <= haystacklen - needlelen; i++) {
-        if(memcmp(h + i, n, needlelen) == 0)
-            return (void*)(h + i);
+/* The values are left in place, and only counted. */
+static const unsigned char *
+parse_values(const unsigned char *p, const unsigned char *end,
+             struct message *m)
+{
+    const unsigned char *s;
+    int len;
+
+    p++;
+    m->values = p;
+    while(p < end && *p != 'e') {
+        p = bstring(p, end, &s, &len);
+        if(p == NULL)
+            return NULL;
+        if(len == 6)
+            m->numvalues++;
+        else if(len == 18)
+            m->numvalues6++;
+        else
+            debugf("Received weird value -- %d bytes.\n", len);
     }
-    return NULL;
+    if(p >= end)
+        return NULL;
+    m->values_len = p - m->values;
+    return p + 1;
 }
 
-#endif
+static const unsigned char *
+parse_want(const unsigned char *p, const unsigned char *end,
+           struct message *m)
+{
+    const unsigned char *s;
+    int len;
+
+    m->want = 0;
+    p++;
+    while(p < end && *p != 'e') {
+        p = bstring(p, end, &s, &len);
+        if(p == NULL)
+            return NULL;
+        if(KEY(s, len, "n4"))
+            m->want |= WANT4;
+        else if(KEY(s, len, "n6"))
+            m->want |= WANT6;
+        else
+            debugf("eek... unexpected want flag (%d bytes)\n", len);
+    }
+    return p < end ? p + 1 : NULL;
+}
 
-static int
-parse_message(const unsigned char *buf, int buflen,
-              unsigned char *tid_return, int *tid_len,
-              unsigned char *id_return, unsigned char *info_hash_return,
-              unsigned char *target_return, unsigned short *port_return,
-              unsigned char *token_return, int *token_len,
-              unsigned char *nodes_return, int *nodes_len,
-              unsigned char *nodes6_return, int *nodes6_len,
-              unsigned char *values_return, int *values_len,
-              unsigned char *values6_return, int *values6_len,
-              int *want_return)
+/* Parse the dictionary of arguments of a query, or of values of a
+   reply, both of which have the same keys. */
+static const unsigned char *
+parse_arguments(const unsigned char *p, const unsigned char *end,
+                struct message *m)
 {
-    const unsigned char *p;
+    const unsigned char *k, *s;
+    int klen, len;
+    long l;
 
-    /* This code will happily crash if the buffer is not NUL-terminated. */
-    if(buf[buflen] != '\0') {
-        debugf("Eek!  parse_message with unterminated buffer.\n");
-        return -1;
-    }
+    if(p >= end || *p != 'd')
+        return NULL;
+    p++;
+    while(p < end && *p != 'e') {
+        p = bstring(p, end, &k, &klen);
+        if(p == NULL || p >= end)
+            return NULL;
 
-#define CHECK(ptr, len)                                                 \
-    if(((unsigned char*)ptr) + (len) > (buf) + (buflen)) goto overflow;
-
-    if(tid_return) {
-        p = dht_memmem(buf, buflen, "1:t", 3);
-        if(p) {
-            long l;
-            char *q;
-            l = strtol((char*)p + 3, &q, 10);
-            if(q && *q == ':' && l > 0 && l < *tid_len) {
-                CHECK(q + 1, l);
-                memcpy(tid_return, q + 1, l);
-                *tid_len = l;
-            } else
-                *tid_len = 0;
-        }
-    }
-    if(id_return) {
-        p = dht_memmem(buf, buflen, "2:id20:", 7);
-        if(p) {
-            CHECK(p + 7, 20);
-            memcpy(id_return, p + 7, 20);
-        } else {
-            memset(id_return, 0, 20);
-        }
-    }
-    if(info_hash_return) {
-        p = dht_memmem(buf, buflen, "9:info_hash20:", 14);
-        if(p) {
-            CHECK(p + 14, 20);
-            memcpy(info_hash_return, p + 14, 20);
-        } else {
-            memset(info_hash_return, 0, 20);
+        if(*p == 'i') {
+            p = bint(p, end, &l);
+            if(p == NULL)
+                return NULL;
+            if(KEY(k, klen, "port"))
+                m->port = l > 0 && l < 0x10000 ? l : 0;
+            else if(KEY(k, klen, "scrape"))
+                m->scrape = l == 1;
+            else if(KEY(k, klen, "seed"))
+                m->seed = l == 1;
+            continue;
         }
-    }
-    if(port_return) {
-        p = dht_memmem(buf, buflen, "porti", 5);
-        if(p) {
-            long l;
-            char *q;
-            l = strtol((char*)p + 5, &q, 10);
-            if(q && *q == 'e' && l > 0 && l < 0x10000)
-                *port_return = l;
-            else
-                *port_return = 0;
-        } else
-            *port_return = 0;
-    }
-    if(target_return) {
-        p = dht_memmem(buf, buflen, "6:target20:", 11);
-        if(p) {
-            CHECK(p + 11, 20);
-            memcpy(target_return, p + 11, 20);
+
+        if(*p == 'l' && KEY(k, klen, "values")) {
+            p = parse_values(p, end, m);
+        } else if(*p == 'l' && KEY(k, klen, "want")) {
+            p = parse_want(p, end, m);
+        } else if(*p < '0' || *p > '9') {
+            p = bskip(p, end, 1);
         } else {
-            memset(target_return, 0, 20);
-        }
-    }
-    if(token_return) {
-        p = dht_memmem(buf, buflen, "5:token", 7);
-        if(p) {
-            long l;
-            char *q;
-            l = strtol((char*)p + 7, &q, 10);
-            if(q && *q == ':' && l > 0 && l < *token_len) {
-                CHECK(q + 1, l);
-                memcpy(token_return, q + 1, l);
-                *token_len = l;
-            } else
-                *token_len = 0;
-        } else
-            *token_len = 0;
-    }
-
-    if(nodes_len) {
-        p = dht_memmem(buf, buflen, "5:nodes", 7);
-        if(p) {
-            long l;
-            char *q;
-            l = strtol((char*)p + 7, &q, 10);
-            if(q && *q == ':' && l > 0 && l < *nodes_len) {
-                CHECK(q + 1, l);
-                memcpy(nodes_return, q + 1, l);
-                *nodes_len = l;
-            } else
-                *nodes_len = 0;
-        } else
-            *nodes_len = 0;
-    }
-
-    if(nodes6_len) {
-        p = dht_memmem(buf, buflen, "6:nodes6", 8);
-        if(p) {
-            long l;
-            char *q;
-            l = strtol((char*)p + 8, &q, 10);
-            if(q && *q == ':' && l > 0 && l < *nodes6_len) {
-                CHECK(q + 1, l);
-                memcpy(nodes6_return, q + 1, l);
-                *nodes6_len = l;
-            } else
-                *nodes6_len = 0;
-        } else
-            *nodes6_len = 0;
-    }
-
-    if(values_len || values6_len) {
-        p = dht_memmem(buf, buflen, "6:valuesl", 9);
-        if(p) {
-            int i = p - buf + 9;
-            int j = 0, j6 = 0;
-            while(1) {
-                long l;
-                char *q;
-                l = strtol((char*)buf + i, &q, 10);
-                if(q && *q == ':' && l > 0) {
-                    CHECK(q + 1, l);
-                    i = q + 1 + l - (char*)buf;
-                    if(l == 6) {
-                        if(j + l > *values_len)
-                            continue;
-                        memcpy((char*)values_return + j, q + 1, l);
-                        j += l;
-                    } else if(l == 18) {
-                        if(j6 + l > *values6_len)
-                            continue;
-                        memcpy((char*)values6_return + j6, q + 1, l);
-                        j6 += l;
-                    } else {
-                        debugf("Received weird value -- %d bytes.\n", (int)l);
-                    }
-                } else {
-                    break;
+            p = bstring(p, end, &s, &len);
+            if(p == NULL)
+                return NULL;
+            if(KEY(k, klen, "id")) {
+                if(len == 20)
+                    memcpy(m->id, s, 20);
+            } else if(KEY(k, klen, "info_hash")) {
+                if(len == 20)
+                    memcpy(m->info_hash, s, 20);
+            } else if(KEY(k, klen, "target")) {
+                if(len == 20)
+                    memcpy(m->target, s, 20);
+            } else if(KEY(k, klen, "token")) {
+                m->token = s;
+                m->token_len = len;
+            } else if(KEY(k, klen, "nodes")) {
+                m->nodes = s;
+                m->nodes_len = len;
+            } else if(KEY(k, klen, "nodes6")) {
+                m->nodes6 = s;
+                m->nodes6_len = len;
+            } else if(KEY(k, klen, "samples")) {
+                if(len % 20 == 0) {
+                    m->samples = s;
+                    m->samples_len = len;
                 }
+            } else if(KEY(k, klen, "BFsd")) {
+                if(len == BLOOM_SIZE)
+                    m->bfsd = s;
+            } else if(KEY(k, klen, "BFpe")) {
+                if(len == BLOOM_SIZE)
+                    m->bfpe = s;
             }
-            if(i >= buflen || buf[i] != 'e')
-                debugf("eek... unexpected end for values.\n");
-            if(values_len)
-                *values_len = j;
-            if(values6_len)
-                *values6_len = j6;
-        } else {
-            if(values_len)
-                *values_len = 0;
-            if(values6_len)
-                *values6_len = 0;
-        }
-    }
-
-    if(want_return) {
-        p = dht_memmem(buf, buflen, "4:wantl", 7);
-        if(p) {
-            int i = p - buf + 7;
-            *want_return = 0;
-            while(buf[i] > '0' && buf[i] <= '9' && buf[i + 1] == ':' &&
-                  i + 2 + buf[i] - '0' < buflen) {
-                CHECK(buf + i + 2, buf[i] - '0');
-                if(buf[i] == '2' && memcmp(buf + i + 2, "n4", 2) == 0)
-                    *want_return |= WANT4;
-                else if(buf[i] == '2' && memcmp(buf + i + 2, "n6", 2) == 0)
-                    *want_return |= WANT6;
-                else
-                    debugf("eek... unexpected want flag (%c)\n", buf[i]);
-                i += 2 + buf[i] - '0';
+        }
+        if(p == NULL)
+            return NULL;
+    }
+    return p < end ? p + 1 : NULL;
+}
+
+static int
+parse_message(const unsigned char *buf, int buflen, struct message *m)
+{
+    const unsigned char *p = buf, *end = buf + buflen;
+    const unsigned char *k, *s;
+    int klen, len, y = 0, q = -1;
+
+    m->tid_len = 0;
+    memset(m->id, 0, 20);
+    memset(m->info_hash, 0, 20);
+    memset(m->target, 0, 20);
+    m->port = 0;
+    m->token = m->nodes = m->nodes6 = m->values = m->samples = buf;
+    m->token_len = m->nodes_len = m->nodes6_len = 0;
+    m->values_len = m->numvalues = m->numvalues6 = 0;
+    m->want = -1;
+    m->scrape = m->seed = 0;
+    m->bfsd = m->bfpe = NULL;
+    m->samples_len = 0;
+
+    if(p >= end || *p != 'd')
+        goto fail;
+    p++;
+    while(p < end && *p != 'e') {
+        p = bstring(p, end, &k, &klen);
+        if(p == NULL)
+            goto fail;
+        if(KEY(k, klen, "a") || KEY(k, klen, "r")) {
+            p = parse_arguments(p, end, m);
+        } else if(KEY(k, klen, "t") && p < end && *p >= '0' && *p <= '9') {
+            p = bstring(p, end, &s, &len);
+            if(p && len < (int)sizeof(m->tid)) {
+                memcpy(m->tid, s, len);
+                m->tid_len = len;
             }
-            if(i >= buflen || buf[i] != 'e')
-                debugf("eek... unexpected end for want.\n");
+        } else if(KEY(k, klen, "y") && p < end && *p >= '0' && *p <= '9') {
+            p = bstring(p, end, &s, &len);
+            if(p && len == 1)
+                y = s[0];
+        } else if(KEY(k, klen, "q") && p < end && *p >= '0' && *p <= '9') {
+            p = bstring(p, end, &s, &len);
+            if(p == NULL)
+                goto fail;
+            if(KEY(s, len, "ping"))
+                q = PING;
+            else if(KEY(s, len, "find_node"))
+                q = FIND_NODE;
+            else if(KEY(s, len, "get_peers"))
+                q = GET_PEERS;
+            else if(KEY(s, len, "announce_peer"))
+                q = ANNOUNCE_PEER;
+            else if(KEY(s, len, "sample_infohashes"))
+                q = SAMPLE_INFOHASHES;
         } else {
-            *want_return = -1;
+            p = bskip(p, end, 1);
         }
+        if(p == NULL)
+            goto fail;
     }
+    if(p >= end)
+        goto fail;
 
-#undef CHECK
-
-    if(dht_memmem(buf, buflen, "1:y1:r", 6))
-        return REPLY;
-    if(dht_memmem(buf, buflen, "1:y1:e", 6))
-        return ERROR;
-    if(!dht_memmem(buf, buflen, "1:y1:q", 6))
-        return -1;
-    if(dht_memmem(buf, buflen, "1:q4:ping", 9))
-        return PING;
-    if(dht_memmem(buf, buflen, "1:q9:find_node", 14))
-       return FIND_NODE;
-    if(dht_memmem(buf, buflen, "1:q9:get_peers", 14))
-        return GET_PEERS;
-    if(dht_memmem(buf, buflen, "1:q13:announce_peer", 19))
-       return ANNOUNCE_PEER;
-    return -1;
+    switch(y) {
+    case 'r': return REPLY;
+    case 'e': return ERROR;
+    case 'q': return q;
+    default: return -1;
+    }
 
- overflow:
-    debugf("Truncated message.\n");
+ fail:
+    debugf("Truncated or malformed message.\n");
     return -1;
 }
+
+#undef KEY
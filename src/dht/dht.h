@@ -30,6 +30,41 @@ dht_callback(void *closure, int event,
 #define DHT_EVENT_VALUES6 2
 #define DHT_EVENT_SEARCH_DONE 3
 #define DHT_EVENT_SEARCH_DONE6 4
+#define DHT_EVENT_SCRAPE 5      /* BFsd then BFpe, 256 octets each */
+#define DHT_EVENT_SAMPLES 6     /* 20-octet infohashes */
+
+/* Tunables for dht_set_option.  Times are in milliseconds. */
+#define DHT_OPT_MIN_TIMEOUT 1
+#define DHT_OPT_MAX_TIMEOUT 2
+#define DHT_OPT_SEARCH_ALPHA 3
+#define DHT_OPT_SEARCH_MAX_ALPHA 4
+#define DHT_OPT_SEARCH_REPLY_DRIVEN 5
+#define DHT_OPT_SEARCH_BATCH 6
+#define DHT_OPT_SEARCH_RATE 7
+#define DHT_OPT_SEARCH_BUDGET 8
+#define DHT_OPT_SEARCH_CACHE_TTL 9
+#define DHT_OPT_SEARCH_CACHE_REFRESH 10
+#define DHT_OPT_STORAGE_BUDGET 11
+#define DHT_OPT_MAX_HASHES 12
+#define DHT_OPT_MAX_PEERS 13
+#define DHT_OPT_REQUEST_RATE 14
+#define DHT_OPT_PREFIX_RATE 15
+#define DHT_OPT_ANNOUNCE_RATE 16
+#define DHT_OPT_SHED_LOAD 17    /* percent, 0 never sheds */
+#define DHT_OPT_SEND_RATE 18    /* packets per second, 0 for no limit */
+
+/* Message types for dht_message_stats. */
+#define DHT_MESSAGE_REPLY 1
+#define DHT_MESSAGE_PING 2
+#define DHT_MESSAGE_FIND_NODE 3
+#define DHT_MESSAGE_GET_PEERS 4
+#define DHT_MESSAGE_ANNOUNCE_PEER 5
+#define DHT_MESSAGE_SAMPLE_INFOHASHES 6
+
+/* Classes of outgoing packets for dht_send_stats. */
+#define DHT_SEND_REPLY 0
+#define DHT_SEND_SEARCH 1
+#define DHT_SEND_MAINTENANCE 2
 
 extern FILE *dht_debug;
 
@@ -39,20 +74,35 @@ int dht_ping_node(struct sockaddr *sa, int salen);
 int dht_periodic(const void *buf, size_t buflen,
                  const struct sockaddr *from, int fromlen,
                  time_t *tosleep, dht_callback *callback, void *closure);
+void dht_timeout(struct timeval *tv_return);
 int dht_search(const unsigned char *id, int port, int af,
                dht_callback *callback, void *closure);
+int dht_search_ext(const unsigned char *id, int port, int af,
+                   int max_peers, int priority,
+                   dht_callback *callback, void *closure);
+int dht_search_cancel(const unsigned char *id, int af);
+int dht_search_many(const unsigned char *ids, int n, int port, int af);
+int dht_scrape(const unsigned char *id, int af,
+               dht_callback *callback, void *closure);
+int dht_sample(const unsigned char *target, int af,
+               dht_callback *callback, void *closure);
 int dht_nodes(int af,
               int *good_return, int *dubious_return, int *cached_return,
               int *incoming_return);
 void dht_dump_tables(FILE *f);
 int dht_get_nodes(struct sockaddr_in *sin, int *num,
                   struct sockaddr_in6 *sin6, int *num6);
+int dht_set_option(int option, int value);
+int dht_get_option(int option);
+void dht_set_load(int load);
+int dht_message_stats(int type, unsigned long *received_return,
+                      unsigned long *limited_return,
+                      unsigned long *shed_return);
+int dht_send_stats(int class, unsigned long *sent_return,
+                   unsigned long *deferred_return,
+                   unsigned long *dropped_return);
 int dht_uninit(void);
 
 /* This must be provided by the user. */
 int dht_blacklisted(const struct sockaddr *sa, int salen);
-void dht_hash(void *hash_return, int hash_size,
-              const void *v1, int len1,
-              const void *v2, int len2,
-              const void *v3, int len3);
 int dht_random_bytes(void *buf, size_t size);
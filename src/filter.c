@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+#include "blocklist.h"
+#include "filter.h"
+
+#ifdef SO_ATTACH_FILTER
+
+/* A socket filter drops the datagrams that we would discard anyway
+   before they are queued on the socket: those that are too large or
+   that do not start with a bencoded dictionary, those from port 0 and,
+   for IPv4, those from martian addresses or from the widest ranges of
+   the blocklist.  Everything else is still checked in userspace.
+
+   On a UDP socket, the filter sees the packet from the UDP header on. */
+
+#define UDP_HEADER 8
+#define ACCEPT 0xFFFFFFFF
+
+/* Martian IPv4 sources, as in is_martian. */
+static const uint32_t martians[][2] = {
+	{0x00000000, 0x00FFFFFF},
+	{0x7F000000, 0x7FFFFFFF},
+	{0xE0000000, 0xFFFFFFFF}
+};
+
+#define NUMMARTIANS (int)(sizeof(martians) / sizeof(martians[0]))
+
+/* Emit a balanced search tree over the sorted ranges a to b, with the
+   source address in the accumulator.  Every range takes 4 instructions,
+   every empty subtree one. */
+static void
+emit_tree(struct sock_filter *prog, int *n,
+          const uint32_t *lo, const uint32_t *hi, int a, int b)
+{
+	struct sock_filter ret_accept = BPF_STMT(BPF_RET | BPF_K, ACCEPT);
+	int i, m;
+
+	if(a >= b)
+	{
+		prog[(*n)++] = ret_accept;
+		return;
+	}
+
+	m = a + (b - a) / 2;
+	i = *n;
+	*n += 4;
+	prog[i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, hi[m], 0, 1);
+	prog[i + 2] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, lo[m], 0, 1);
+	prog[i + 3] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	emit_tree(prog, n, lo, hi, a, m);
+	prog[i + 1] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, *n - (i + 2));
+	emit_tree(prog, n, lo, hi, m + 1, b);
+}
+
+/* Attach a filter to s, or replace the one attached, passing packets
+   with up to maxlen bytes of payload. */
+int
+filter_attach(int s, int af, int maxlen)
+{
+	struct sock_filter prog[BPF_MAXINSNS];
+	struct sock_fprog fprog;
+	uint32_t lo[NUMMARTIANS + FILTER_MAX_RANGES];
+	uint32_t hi[NUMMARTIANS + FILTER_MAX_RANGES];
+	int i, j, k, n = 0, numranges = 0;
+
+	if(af == AF_INET)
+	{
+		uint32_t blo[FILTER_MAX_RANGES], bhi[FILTER_MAX_RANGES];
+		int numblocked = blocklist_widest4(blo, bhi, FILTER_MAX_RANGES);
+		if(numblocked < 0)
+			return -1;
+
+		/* Merge both sorted lists, then coalesce overlapping ranges. */
+		i = j = 0;
+		while(i < NUMMARTIANS || j < numblocked)
+		{
+			if(j >= numblocked || (i < NUMMARTIANS && martians[i][0] <= blo[j]))
+			{
+				lo[numranges] = martians[i][0];
+				hi[numranges] = martians[i][1];
+				i++;
+			}
+			else
+			{
+				lo[numranges] = blo[j];
+				hi[numranges] = bhi[j];
+				j++;
+			}
+			if(numranges > 0 && lo[numranges] <= hi[numranges - 1])
+			{
+				if(hi[numranges] > hi[numranges - 1])
+					hi[numranges - 1] = hi[numranges];
+			}
+			else
+			{
+				numranges++;
+			}
+		}
+	}
+
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+	k = n++;
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, UDP_HEADER);
+	prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 'd', 0, 0);
+	j = n++;
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0);
+	i = n++;
+	if(af == AF_INET)
+	{
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12);
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, 1);
+	}
+	else
+	{
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, ACCEPT);
+	}
+
+	/* The checks above all share this drop. */
+	prog[k] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K,
+	                                       UDP_HEADER + maxlen, n - (k + 1), 0);
+	prog[j].jf = n - (j + 1);
+	prog[i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, n - (i + 1), 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	if(af == AF_INET)
+		emit_tree(prog, &n, lo, hi, 0, numranges);
+
+	fprog.len = n;
+	fprog.filter = prog;
+	return setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+}
+
+#else
+
+int
+filter_attach(int s, int af, int maxlen)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+/* Room left for blocklist ranges in a classic BPF program, which is at
+   most 4096 instructions long. */
+#define FILTER_MAX_RANGES 800
+
+int filter_attach(int s, int af, int maxlen);
+
+#endif /* FILTER_H */
@@ -0,0 +1,102 @@
+/* Times the building of every kind of message we send.  The send
+   functions are static, so this includes dht.c whole.  No socket is
+   open, so each message is built and handed to dht_send, which refuses
+   it without making a system call.  Build and run from this directory
+   with
+
+       make bench */
+
+#include "../src/dht/dht.c"
+
+#include <time.h>
+
+int
+dht_blacklisted(const struct sockaddr *sa, int salen)
+{
+    return 0;
+}
+
+int
+dht_random_bytes(void *buf, size_t size)
+{
+    memset(buf, 0x2A, size);
+    return size;
+}
+
+static double
+nanoseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define ROUNDS 2000000
+
+#define BENCH(name, call)                                               \
+    do {                                                                \
+        double start = nanoseconds();                                   \
+        for(i = 0; i < ROUNDS; i++)                                     \
+            call;                                                       \
+        printf("%-14s %6.1f ns\n", name,                                \
+               (nanoseconds() - start) / ROUNDS);                       \
+    } while(0)
+
+int
+main(int argc, char **argv)
+{
+    unsigned char myid[20], id[20], tid[4] = {'g', 'p', 0, 1};
+    unsigned char token[8], nodes[8 * 26];
+    struct sockaddr_in sin;
+    struct storage *st;
+    int i, rc;
+
+    for(i = 0; i < 20; i++) {
+        myid[i] = 0x30 + i;
+        id[i] = 0x60 + i;
+    }
+    memset(token, 0x3A, sizeof(token));
+    memset(nodes, 0x31, sizeof(nodes));
+
+    rc = dht_init(-1, -1, myid, (unsigned char*)"JC\0\1");
+    if(rc < 0) {
+        perror("dht_init");
+        return 1;
+    }
+
+    /* Enough peers for a full values reply. */
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    for(i = 0; i < 30; i++) {
+        sin.sin_addr.s_addr = htonl(0x0A000000 + i);
+        storage_store(id, (struct sockaddr*)&sin, 1000 + i, i % 3 == 0);
+    }
+    st = find_storage(id);
+    if(st == NULL) {
+        fprintf(stderr, "Couldn't store peers.\n");
+        return 1;
+    }
+
+    sin.sin_addr.s_addr = htonl(0x7F000001);
+    sin.sin_port = htons(6881);
+#define SA (struct sockaddr*)&sin, sizeof(sin)
+
+    BENCH("ping", send_ping(SA, tid, 4));
+    BENCH("pong", send_pong(SA, tid, 4));
+    BENCH("find_node", send_find_node(SA, tid, 4, id, 3, 0));
+    BENCH("get_peers", send_get_peers(SA, tid, 4, id, 1, 0, 0));
+    BENCH("announce_peer",
+          send_announce_peer(SA, tid, 4, id, 6881, token, 8, 0));
+    BENCH("nodes reply",
+          send_nodes_peers(SA, tid, 4, nodes, sizeof(nodes), NULL, 0,
+                           0, NULL, 0, 0, token, 8));
+    BENCH("values reply",
+          send_nodes_peers(SA, tid, 4, nodes, sizeof(nodes), NULL, 0,
+                           AF_INET, st, 0, 0, token, 8));
+    BENCH("error",
+          send_error(SA, tid, 4, 203, "Announce_peer with wrong token"));
+
+#undef SA
+    return 0;
+}
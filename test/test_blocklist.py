@@ -0,0 +1,194 @@
+from __future__ import print_function
+import random, socket, struct, sys
+from dht import DHT
+
+# Checks DHT.blocklist against a naive model: a list of ranges and a set of
+# single addresses, with ranges merged when they overlap but not when they
+# are merely adjacent, as blocklist_count reports them.  It needs the module
+# built and importable, and takes an optional random seed:
+#   python test_blocklist.py [seed]
+
+BITS = {DHT.IPV4: 32, DHT.IPV6: 128}
+
+class Model:
+	def __init__(self):
+		self.clear()
+	def clear(self):
+		self.ranges = {DHT.IPV4: [], DHT.IPV6: []}
+		self.singles = {DHT.IPV4: set(), DHT.IPV6: set()}
+	def add(self, family, addr, prefix):
+		bits = BITS[family]
+		if prefix == bits:
+			# The unspecified address marks empty slots and is never stored.
+			if addr != 0:
+				self.singles[family].add(addr)
+			return
+		host = (1 << (bits - prefix)) - 1
+		self.ranges[family].append((addr & ~host, addr | host))
+	def blocked(self, family, addr):
+		if addr in self.singles[family]:
+			return True
+		return any(lo <= addr <= hi for lo, hi in self.ranges[family])
+	def merged(self, family):
+		out = []
+		for lo, hi in sorted(self.ranges[family]):
+			if out and lo <= out[-1][1]:
+				out[-1][1] = max(out[-1][1], hi)
+			else:
+				out.append([lo, hi])
+		return out
+	def count(self):
+		return (len(self.singles[DHT.IPV4]) + len(self.singles[DHT.IPV6]),
+		        len(self.merged(DHT.IPV4)) + len(self.merged(DHT.IPV6)))
+
+def pack(family, addr, prefix):
+	if family == DHT.IPV4:
+		return struct.pack('!IB', addr, prefix)
+	return struct.pack('!QQB', addr >> 64, addr & (2 ** 64 - 1), prefix)
+
+def text(family, addr):
+	if family == DHT.IPV4:
+		return socket.inet_ntoa(struct.pack('!I', addr))
+	return socket.inet_ntop(socket.AF_INET6, struct.pack('!QQ', addr >> 64, addr & (2 ** 64 - 1)))
+
+failures = 0
+
+def check(cond, what):
+	global failures
+	if not cond:
+		failures += 1
+		print("FAIL:", what)
+
+def add(d, model, family, records):
+	data = b''.join(pack(family, a, p) for a, p in records)
+	check(d.blocklist(data, family) == len(records), "record count for %r" % (records,))
+	for a, p in records:
+		model.add(family, a, p)
+
+def probes(model, family):
+	bits = BITS[family]
+	top = 2 ** bits - 1
+	points = set([0, 1, top - 1, top])
+	for lo, hi in model.ranges[family]:
+		points.update([lo, hi, lo - 1, hi + 1])
+	for a in model.singles[family]:
+		points.update([a, a - 1, a + 1])
+	if family == DHT.IPV4:
+		# The lookup narrows its search to one /16, so look on both sides
+		# of the /16 boundaries around every range.
+		for lo, hi in model.ranges[family]:
+			for a in (lo, hi):
+				k = a & 0xFFFF0000
+				points.update([k, k - 1, k + 0x10000, k + 0xFFFF])
+	points.update(random.randint(0, top) for i in range(200))
+	return [p for p in points if 0 <= p <= top]
+
+def compare(d, model, label):
+	check(d.blocklist_count() == model.count(),
+	      "%s: blocklist_count() is %r, expected %r" % (label, d.blocklist_count(), model.count()))
+	for family in (DHT.IPV4, DHT.IPV6):
+		for a in probes(model, family):
+			got = d.blocked(text(family, a))
+			want = model.blocked(family, a)
+			check(got == want, "%s: blocked(%s) is %r, expected %r" % (label, text(family, a), got, want))
+
+def v4(s):
+	return struct.unpack('!I', socket.inet_aton(s))[0]
+
+def v6(s):
+	hi, lo = struct.unpack('!QQ', socket.inet_pton(socket.AF_INET6, s))
+	return (hi << 64) | lo
+
+def reset(d, model):
+	d.blocklist_clear()
+	model.clear()
+	check(d.blocklist_count() == (0, 0), "blocklist_clear() leaves %r" % (d.blocklist_count(),))
+
+def fixed_cases(d, model):
+	cases = [
+		("/0", DHT.IPV4, [(v4('1.2.3.4'), 0)]),
+		("/32 and the unspecified address", DHT.IPV4,
+		 [(v4('203.0.113.7'), 32), (v4('203.0.113.7'), 32), (0, 32), (v4('255.255.255.255'), 32)]),
+		("overlapping", DHT.IPV4, [(v4('172.16.0.0'), 12), (v4('172.20.5.0'), 24), (v4('172.31.255.0'), 24)]),
+		("adjacent", DHT.IPV4, [(v4('192.168.0.0'), 24), (v4('192.168.1.0'), 24), (v4('192.168.2.0'), 23)]),
+		("crossing a /16", DHT.IPV4, [(v4('10.0.0.0'), 15), (v4('10.4.0.0'), 14), (v4('10.9.255.254'), 31)]),
+		("ending on a /16", DHT.IPV4, [(v4('100.64.255.0'), 24), (v4('100.65.0.0'), 24)]),
+		("unaligned records", DHT.IPV4, [(v4('198.51.100.77'), 24), (v4('10.200.1.2'), 9)]),
+		("IPv6 /0", DHT.IPV6, [(v6('2001:db8::1'), 0)]),
+		("IPv6 /128 and the unspecified address", DHT.IPV6,
+		 [(v6('2001:db8::1'), 128), (v6('2001:db8::1'), 128), (0, 128), (2 ** 128 - 1, 128)]),
+		("IPv6 overlapping", DHT.IPV6, [(v6('2001:db8::'), 32), (v6('2001:db8:1::'), 48)]),
+		("IPv6 adjacent", DHT.IPV6, [(v6('2001:db8:0:1::'), 64), (v6('2001:db8:0:2::'), 64), (v6('fe80::'), 10)]),
+	]
+	for label, family, records in cases:
+		reset(d, model)
+		add(d, model, family, records)
+		compare(d, model, label)
+
+	# Everything together, added in several calls.
+	reset(d, model)
+	for label, family, records in cases:
+		if not label.endswith("/0"):
+			add(d, model, family, records)
+	compare(d, model, "all cases")
+
+def random_address(family):
+	bits = BITS[family]
+	a = random.getrandbits(bits)
+	if family == DHT.IPV4 and random.random() < 0.5:
+		# Close to a /16 boundary, on either side.
+		a = ((a & 0xFFFF0000) + random.randint(-300, 300)) % 2 ** 32
+	return a
+
+def random_prefix(family):
+	if family == DHT.IPV4:
+		return random.choice([0] + list(range(8, 33)) * 3 + [32] * 20)
+	return random.choice([0] + list(range(16, 129)) + [128] * 40)
+
+def random_cases(d, model, rounds):
+	for r in range(rounds):
+		reset(d, model)
+		for batch in range(random.randint(1, 4)):
+			family = random.choice([DHT.IPV4, DHT.IPV6])
+			records = []
+			for i in range(random.randint(1, 60)):
+				prefix = random_prefix(family)
+				if prefix == 0 and random.random() < 0.9:
+					prefix = BITS[family]
+				if records and random.random() < 0.3:
+					# Next to or inside an earlier record.
+					a, p = random.choice(records)
+					size = 2 ** (BITS[family] - p) if p < BITS[family] else 1
+					a = (a + random.choice([-size, size, 0])) % 2 ** BITS[family]
+				else:
+					a = random_address(family)
+				records.append((a, prefix))
+			add(d, model, family, records)
+		compare(d, model, "random round %d" % r)
+
+def invalid_records(d, model):
+	reset(d, model)
+	add(d, model, DHT.IPV4, [(v4('192.0.2.0'), 24)])
+	for family, data in [(DHT.IPV4, pack(DHT.IPV4, v4('10.0.0.0'), 8) + pack(DHT.IPV4, 0, 33)),
+	                     (DHT.IPV4, b'\x0a\x00\x00'),
+	                     (DHT.IPV6, pack(DHT.IPV6, 0, 129))]:
+		try:
+			d.blocklist(data, family)
+			check(False, "invalid records %r accepted" % (data,))
+		except ValueError:
+			pass
+	# A buffer with an invalid record adds nothing at all.
+	compare(d, model, "after invalid records")
+
+random.seed(int(sys.argv[1]) if len(sys.argv) > 1 else 1)
+d = DHT(b'\x42' * 20, 18881, DHT.IPV4, '127.0.0.1')
+model = Model()
+fixed_cases(d, model)
+random_cases(d, model, 200)
+invalid_records(d, model)
+d.blocklist_clear()
+
+if failures:
+	print("%d failures" % failures)
+	sys.exit(1)
+print("blocklist ok")
@@ -0,0 +1,229 @@
+/* Regression tests for the parser of incoming messages.  The parser is
+   static, so this includes dht.c whole.  Build and run from this
+   directory, along with the other C tests, with
+
+       make check
+
+   Every message is copied into a buffer of its exact size, so that the
+   sanitizer catches any read past its end. */
+
+#include "../src/dht/dht.c"
+
+int
+dht_blacklisted(const struct sockaddr *sa, int salen)
+{
+    return 0;
+}
+
+int
+dht_random_bytes(void *buf, size_t size)
+{
+    memset(buf, 0x2A, size);
+    return size;
+}
+
+#define ID "abcdefghij0123456789"
+
+static int failures;
+
+static int
+parse(const char *data, int len, struct message *m)
+{
+    unsigned char *buf = malloc(len > 0 ? len : 1);
+    int rc;
+
+    if(buf == NULL)
+        abort();
+    memcpy(buf, data, len);
+    rc = parse_message(buf, len, m);
+    free(buf);
+    return rc;
+}
+
+static void
+expect(const char *what, const char *data, int len, int want)
+{
+    struct message m;
+    int rc = parse(data, len, &m);
+
+    if(rc != want) {
+        printf("FAIL: %s: parse_message returned %d, expected %d\n",
+               what, rc, want);
+        failures++;
+    }
+}
+
+/* Every proper prefix of a valid message must be refused. */
+static void
+expect_truncated(const char *what, const char *data, int len)
+{
+    char label[100];
+    int i;
+
+    for(i = 0; i < len; i++) {
+        snprintf(label, sizeof(label), "%s cut at %d", what, i);
+        expect(label, data, i, -1);
+    }
+}
+
+/* A ping whose arguments carry an unknown key holding depth nested
+   lists. */
+static char *
+nested(int depth)
+{
+    const char *head = "d1:ad2:id20:" ID "3:fool";
+    const char *tail = "ee1:q4:ping1:t2:aa1:y1:qe";
+    char *buf = malloc(strlen(head) + 2 * depth + strlen(tail) + 1);
+    int i, n = 0;
+
+    if(buf == NULL)
+        abort();
+    n += sprintf(buf, "%s", head);
+    for(i = 1; i < depth; i++)
+        buf[n++] = 'l';
+    for(i = 1; i < depth; i++)
+        buf[n++] = 'e';
+    sprintf(buf + n, "%s", tail);
+    return buf;
+}
+
+static void
+test_valid(void)
+{
+    static const char ping[] = "d1:ad2:id20:" ID "e1:q4:ping1:t2:aa1:y1:qe";
+    static const char reply[] =
+        "d1:rd2:id20:" ID "5:nodes26:" ID "\x01\x02\x03\x04\x1a\xe1"
+        "5:token4:tokn6:valuesl6:\x01\x02\x03\x04\x1a\xe1"
+        "18:0123456789abcdef\x1a\xe1" "ee1:t4:pn\x00\x01" "1:y1:re";
+    static const char announce[] =
+        "d1:ad2:id20:" ID "9:info_hash20:" ID "4:porti6881e"
+        "5:token4:tokne1:q13:announce_peer1:t1:x1:y1:qe";
+    struct message m;
+    int rc;
+
+    rc = parse(ping, sizeof(ping) - 1, &m);
+    if(rc != PING || m.tid_len != 2 || memcmp(m.tid, "aa", 2) != 0 ||
+       memcmp(m.id, ID, 20) != 0) {
+        printf("FAIL: valid ping\n");
+        failures++;
+    }
+
+    rc = parse(reply, sizeof(reply) - 1, &m);
+    if(rc != REPLY || m.nodes_len != 26 || m.token_len != 4 ||
+       m.numvalues != 1 || m.numvalues6 != 1 || m.tid_len != 4) {
+        printf("FAIL: valid reply\n");
+        failures++;
+    }
+
+    rc = parse(announce, sizeof(announce) - 1, &m);
+    if(rc != ANNOUNCE_PEER || m.port != 6881 || m.tid_len != 1 ||
+       memcmp(m.info_hash, ID, 20) != 0) {
+        printf("FAIL: valid announce_peer\n");
+        failures++;
+    }
+
+    expect_truncated("ping", ping, sizeof(ping) - 1);
+    expect_truncated("reply", reply, sizeof(reply) - 1);
+    expect_truncated("announce_peer", announce, sizeof(announce) - 1);
+}
+
+static void
+test_depth(void)
+{
+    char *buf;
+
+    buf = nested(MAX_DEPTH);
+    expect("nesting of MAX_DEPTH", buf, strlen(buf), PING);
+    free(buf);
+
+    buf = nested(MAX_DEPTH + 1);
+    expect("nesting deeper than MAX_DEPTH", buf, strlen(buf), -1);
+    free(buf);
+
+    /* Deep enough to overflow the stack if depth were not bounded. */
+    buf = nested(1000000);
+    expect("nesting a million deep", buf, strlen(buf), -1);
+    free(buf);
+}
+
+static void
+test_lengths(void)
+{
+    static const char *bad[] = {
+        /* One byte longer than what is left. */
+        "d1:ad2:id20:" ID "e1:q4:ping1:t3:aa1:y1:qe",
+        "d1:ad2:id21:" ID "e1:q4:ping1:t2:aa1:y1:qe",
+        /* Lengths that would overflow an int, or a 64-bit size. */
+        "d1:ad2:id20:" ID "e1:q4:ping1:t4294967298:aa1:y1:qe",
+        "d1:ad2:id20:" ID "e1:q4:ping1:t99999999999999999999999:aa1:y1:qe",
+        "d1:ad2:id20:" ID "e1:q4:ping1:t2:aa99999999999999999999:y1:qe",
+        /* Negative and missing lengths. */
+        "d1:ad2:id20:" ID "e1:q4:ping1:t-2:aa1:y1:qe",
+        "d1:ad2:id20:" ID "e1:q4:ping1:t:aa1:y1:qe",
+        /* An unterminated integer in a skipped value. */
+        "d1:ad2:id20:" ID "3:fooi99999999999999999999999e1:q4:ping1:t2:aa1:y1:qe",
+        NULL
+    };
+    const char *saturated =
+        "d1:ad2:id20:" ID "4:porti99999999999999999999999ee"
+        "1:q4:ping1:t2:aa1:y1:qe";
+    struct message m;
+    char label[32];
+    int i, rc;
+
+    for(i = 0; bad[i]; i++) {
+        snprintf(label, sizeof(label), "bad length %d", i);
+        expect(label, bad[i], strlen(bad[i]), -1);
+    }
+
+    /* Integers too large for us saturate rather than overflow. */
+    rc = parse(saturated, strlen(saturated), &m);
+    if(rc != PING || m.port != 0) {
+        printf("FAIL: saturated integer\n");
+        failures++;
+    }
+}
+
+static void
+test_tid(void)
+{
+    static const int lens[] = {0, 1, 15, 16, 17, 255};
+    char buf[512], tid[256];
+    struct message m;
+    int i, n, rc, want;
+
+    memset(tid, 'T', sizeof(tid));
+    for(i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); i++) {
+        n = snprintf(buf, sizeof(buf), "d1:ad2:id20:" ID "e1:q4:ping1:t%d:",
+                     lens[i]);
+        memcpy(buf + n, tid, lens[i]);
+        n += lens[i];
+        n += snprintf(buf + n, sizeof(buf) - n, "1:y1:qe");
+
+        /* A tid that does not fit is ignored, not truncated. */
+        want = lens[i] < (int)sizeof(m.tid) ? lens[i] : 0;
+        rc = parse(buf, n, &m);
+        if(rc != PING || m.tid_len != want ||
+           memcmp(m.tid, tid, m.tid_len) != 0) {
+            printf("FAIL: tid of length %d: returned %d with a tid of "
+                   "length %d\n", lens[i], rc, m.tid_len);
+            failures++;
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    test_valid();
+    test_depth();
+    test_lengths();
+    test_tid();
+
+    if(failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("parser ok\n");
+    return 0;
+}
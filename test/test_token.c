@@ -0,0 +1,215 @@
+/* Tests for the tokens handed out in replies to get_peers.  This checks
+   siphash against the reference outputs of SipHash-2-4, and that a token
+   is accepted under the current and previous secrets only.  Build and
+   run from this directory with
+
+       make check
+
+   Given the argument "bench", it also reports the cost of make_token
+   and token_match; "make bench" builds it without the sanitizers for
+   that. */
+
+#include "../src/dht/dht.c"
+
+#include <time.h>
+
+int
+dht_blacklisted(const struct sockaddr *sa, int salen)
+{
+    return 0;
+}
+
+/* Every call returns different bytes, so that rotating the secrets
+   changes them. */
+int
+dht_random_bytes(void *buf, size_t size)
+{
+    static unsigned char next = 1;
+    size_t i;
+
+    for(i = 0; i < size; i++)
+        ((unsigned char*)buf)[i] = next++;
+    return size;
+}
+
+/* SipHash-2-4 with the key 00 01 ... 0f of the messages 00 01 ... i-1,
+   for i from 0 to 63, as given by the reference implementation. */
+static const uint64_t vectors[64] = {
+    0x726fdb47dd0e0e31ULL, 0x74f839c593dc67fdULL, 0x0d6c8009d9a94f5aULL,
+    0x85676696d7fb7e2dULL, 0xcf2794e0277187b7ULL, 0x18765564cd99a68dULL,
+    0xcbc9466e58fee3ceULL, 0xab0200f58b01d137ULL, 0x93f5f5799a932462ULL,
+    0x9e0082df0ba9e4b0ULL, 0x7a5dbbc594ddb9f3ULL, 0xf4b32f46226bada7ULL,
+    0x751e8fbc860ee5fbULL, 0x14ea5627c0843d90ULL, 0xf723ca908e7af2eeULL,
+    0xa129ca6149be45e5ULL, 0x3f2acc7f57c29bdbULL, 0x699ae9f52cbe4794ULL,
+    0x4bc1b3f0968dd39cULL, 0xbb6dc91da77961bdULL, 0xbed65cf21aa2ee98ULL,
+    0xd0f2cbb02e3b67c7ULL, 0x93536795e3a33e88ULL, 0xa80c038ccd5ccec8ULL,
+    0xb8ad50c6f649af94ULL, 0xbce192de8a85b8eaULL, 0x17d835b85bbb15f3ULL,
+    0x2f2e6163076bcfadULL, 0xde4daaaca71dc9a5ULL, 0xa6a2506687956571ULL,
+    0xad87a3535c49ef28ULL, 0x32d892fad841c342ULL, 0x7127512f72f27cceULL,
+    0xa7f32346f95978e3ULL, 0x12e0b01abb051238ULL, 0x15e034d40fa197aeULL,
+    0x314dffbe0815a3b4ULL, 0x027990f029623981ULL, 0xcadcd4e59ef40c4dULL,
+    0x9abfd8766a33735cULL, 0x0e3ea96b5304a7d0ULL, 0xad0c42d6fc585992ULL,
+    0x187306c89bc215a9ULL, 0xd4a60abcf3792b95ULL, 0xf935451de4f21df2ULL,
+    0xa9538f0419755787ULL, 0xdb9acddff56ca510ULL, 0xd06c98cd5c0975ebULL,
+    0xe612a3cb9ecba951ULL, 0xc766e62cfcadaf96ULL, 0xee64435a9752fe72ULL,
+    0xa192d576b245165aULL, 0x0a8787bf8ecb74b2ULL, 0x81b3e73d20b49b6fULL,
+    0x7fa8220ba3b2eceaULL, 0x245731c13ca42499ULL, 0xb78dbfaf3a8d83bdULL,
+    0xea1ad565322a1a0bULL, 0x60e61c23a3795013ULL, 0x6606d7e446282b93ULL,
+    0x6ca4ecb15c5f91e1ULL, 0x9f626da15c9625f3ULL, 0xe51b38608ef25f57ULL,
+    0x958a324ceb064572ULL
+};
+
+static int failures;
+
+static void
+test_siphash(void)
+{
+    unsigned char key[16], data[64];
+    uint64_t h;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        key[i] = i;
+    for(i = 0; i < 64; i++)
+        data[i] = i;
+
+    for(i = 0; i < 64; i++) {
+        h = siphash(key, data, i);
+        if(h != vectors[i]) {
+            printf("FAIL: siphash of %d octets is %016llx, expected %016llx\n",
+                   i, (unsigned long long)h, (unsigned long long)vectors[i]);
+            failures++;
+        }
+    }
+}
+
+static void
+expect_match(const char *what, const unsigned char *token, int token_len,
+             const void *sa, int want)
+{
+    if(token_match(token, token_len, (const struct sockaddr*)sa) != want) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void
+test_tokens(void)
+{
+    struct sockaddr_in sin, other;
+    struct sockaddr_in6 sin6;
+    unsigned char token[TOKEN_SIZE], token6[TOKEN_SIZE], t[TOKEN_SIZE];
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(0xC0000201);
+    sin.sin_port = htons(6881);
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_addr.s6_addr[0] = 0x20;
+    sin6.sin6_addr.s6_addr[15] = 1;
+    sin6.sin6_port = htons(6881);
+
+    rotate_secrets();
+    rotate_secrets();
+
+    make_token((struct sockaddr*)&sin, 0, token);
+    make_token((struct sockaddr*)&sin6, 0, token6);
+    expect_match("IPv4 token under the current secret",
+                 token, TOKEN_SIZE, &sin, 1);
+    expect_match("IPv6 token under the current secret",
+                 token6, TOKEN_SIZE, &sin6, 1);
+    expect_match("truncated token", token, TOKEN_SIZE - 1, &sin, 0);
+
+    other = sin;
+    other.sin_port = htons(6882);
+    expect_match("token from another port", token, TOKEN_SIZE, &other, 0);
+    other = sin;
+    other.sin_addr.s_addr = htonl(0xC0000202);
+    expect_match("token from another address", token, TOKEN_SIZE, &other, 0);
+
+    rotate_secrets();
+    expect_match("token under the previous secret",
+                 token, TOKEN_SIZE, &sin, 1);
+    make_token((struct sockaddr*)&sin, 0, t);
+    if(memcmp(t, token, TOKEN_SIZE) == 0) {
+        printf("FAIL: token unchanged by rotating the secret\n");
+        failures++;
+    }
+
+    rotate_secrets();
+    expect_match("token after two rotations", token, TOKEN_SIZE, &sin, 0);
+}
+
+static double
+nanoseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define ROUNDS 10000000
+
+static void
+bench(void)
+{
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+    unsigned char token[TOKEN_SIZE];
+    unsigned long sum = 0;
+    double start;
+    int i;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(6881);
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(6881);
+
+    start = nanoseconds();
+    for(i = 0; i < ROUNDS; i++) {
+        sin.sin_addr.s_addr = i;
+        make_token((struct sockaddr*)&sin, 0, token);
+        sum += token[0];
+    }
+    printf("make_token v4      %6.1f ns\n", (nanoseconds() - start) / ROUNDS);
+
+    start = nanoseconds();
+    for(i = 0; i < ROUNDS; i++) {
+        memcpy(sin6.sin6_addr.s6_addr, &i, sizeof(i));
+        make_token((struct sockaddr*)&sin6, 0, token);
+        sum += token[0];
+    }
+    printf("make_token v6      %6.1f ns\n", (nanoseconds() - start) / ROUNDS);
+
+    /* A token under the previous secret, so that both are computed. */
+    make_token((struct sockaddr*)&sin, 1, token);
+    start = nanoseconds();
+    for(i = 0; i < ROUNDS; i++)
+        sum += token_match(token, TOKEN_SIZE, (struct sockaddr*)&sin);
+    printf("token_match (old)  %6.1f ns\n", (nanoseconds() - start) / ROUNDS);
+
+    /* So that the loops are not optimised away. */
+    if(sum == 0)
+        printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    test_siphash();
+    test_tokens();
+
+    if(failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("tokens ok\n");
+
+    if(argc > 1 && strcmp(argv[1], "bench") == 0)
+        bench();
+    return 0;
+}